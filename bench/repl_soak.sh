@@ -0,0 +1,39 @@
+#!/bin/sh
+# Soak test for the REPL: evaluates N top-level expressions (default 1000000) in
+# one session and samples the resident set size while it runs.
+#
+#   bench/repl_soak.sh ./basic-lang [N]
+#
+# Every expression is JIT compiled into a module of its own that is freed after
+# it ran, so RSS levels off after the first samples. Fails if the last sample is
+# more than 10% above the one taken a quarter of the way in.
+BIN=${1:?usage: repl_soak.sh path/to/basic-lang [N]}
+N=${2:-1000000}
+
+awk -v n="$N" 'BEGIN {
+  print "fn step(x) x*x + 1;"
+  for (i = 0; i < n; i++) print "for i = 0, " (i % 7 + 1) " in step(i);"
+}' | "$BIN" > /dev/null 2>&1 &
+PID=$!
+
+SAMPLES=""
+while kill -0 "$PID" 2> /dev/null; do
+  RSS=$(awk '/^VmRSS:/ { print $2 }' "/proc/$PID/status" 2> /dev/null)
+  if [ -n "$RSS" ]; then
+    SAMPLES="$SAMPLES $RSS"
+    echo "rss_kb $RSS"
+  fi
+  sleep 2
+done
+wait "$PID" || { echo "basic-lang failed"; exit 1; }
+
+set -- $SAMPLES
+if [ $# -lt 4 ]; then
+  echo "too few samples ($#), raise N"
+  exit 1
+fi
+shift $(($# / 4 - 1))
+FIRST=$1
+eval "LAST=\${$#}"
+echo "rss_kb after a quarter: $FIRST, at the end: $LAST"
+[ "$LAST" -le $((FIRST + FIRST / 10)) ]
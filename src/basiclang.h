@@ -0,0 +1,108 @@
+// Embedding API: compiles basic-lang source into native functions in-process.
+//
+//   basiclang::Compiler C;
+//   basiclang::Function F = C.compile("fn f(a b) a*b + 1;");
+//   double Y = F(2.0, 3.0);
+//
+// Each Compiler owns its own LLVM context, JIT and symbol tables. A Compiler must
+// only be used by one thread at a time, but any number of them can compile on
+// different threads at once. Compiled functions can be called from any thread and
+// stay valid as long as the Compiler that made them.
+#ifndef BASICLANG_H
+#define BASICLANG_H
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <memory>
+#include <string>
+
+namespace basiclang {
+
+struct CompilerState;
+
+// * A compiled function: double(double, ...) with arity() arguments. Functions that
+//   take arrays have the C signature described in the README, call those through
+//   address().
+class Function {
+private:
+  // [1st] Entry point of f.
+  // [2nd] Entry point of the loop over rows, null for functions that take arrays.
+  // [3rd] Number of arguments, i.e. columns.
+
+  template <typename T> using AsDouble = double;
+
+  void *Address = nullptr; // [1st]
+
+  void *BatchAddress = nullptr; // [2nd]
+
+  unsigned NumArgs = 0; // [3rd]
+
+public:
+  Function() = default;
+  Function(void *Address, void *BatchAddress, unsigned NumArgs)
+      : Address(Address), BatchAddress(BatchAddress), NumArgs(NumArgs) {}
+
+  explicit operator bool() const { return Address != nullptr; }
+  void *address() const { return Address; }
+  unsigned arity() const { return NumArgs; }
+  bool hasBatch() const { return BatchAddress != nullptr; }
+
+  // * Out[k] = f(Columns[0][k], ..., Columns[arity()-1][k]) for k below Rows, in one
+  //   call: the loop is compiled with f inlined into it and vectorized where it can be.
+  void batch(const double *const *Columns, double *Out, size_t Rows) const {
+    assert(BatchAddress && "no batch entry point for functions that take arrays");
+    reinterpret_cast<void (*)(const double *const *, double *, int64_t)>(BatchAddress)(
+        Columns, Out, static_cast<int64_t>(Rows));
+  }
+  void batch(std::initializer_list<const double *> Columns, double *Out, size_t Rows) const {
+    assert(Columns.size() == NumArgs && "wrong number of columns");
+    batch(Columns.begin(), Out, Rows);
+  }
+
+  template <typename... Args> double operator()(Args... As) const {
+    assert(Address && sizeof...(Args) == NumArgs && "wrong number of arguments");
+    return reinterpret_cast<double (*)(AsDouble<Args>...)>(Address)(static_cast<double>(As)...);
+  }
+};
+
+class Compiler {
+private:
+  std::unique_ptr<CompilerState> State;
+
+  Function lookupDefined(unsigned Name);
+
+public:
+  struct Options {
+    unsigned OptLevel = 2; // 0 .. 3, as -O<n>
+    bool FastMath = false; // as --fast-math
+  };
+
+  Compiler();
+  explicit Compiler(const Options &Opts);
+  ~Compiler();
+  Compiler(const Compiler &) = delete;
+  Compiler &operator=(const Compiler &) = delete;
+
+  // * Compiles the definitions (and 'incl' declarations) in Source and returns the
+  //   last function defined. Later compile() and eval() calls can call them. Every
+  //   function of numbers also gets a batch() entry point.
+  //   Returns an empty Function on errors, see error().
+  Function compile(const std::string &Source);
+
+  // * A function defined by an earlier compile(), empty if there is none.
+  Function lookup(const std::string &Name);
+
+  // * Evaluates the top-level expressions in Source and sets Result to the value of
+  //   the last one. Functions defined in Source only live for this call. Returns
+  //   false on errors, see error().
+  bool eval(const std::string &Source, double &Result);
+
+  // * Error messages of the last compile(), lookup() or eval().
+  const std::string &error() const;
+};
+
+} // namespace basiclang
+
+#endif // BASICLANG_H
@@ -1,16 +1,30 @@
 // LLVM INCLUDES
 #include "llvm/ADT/APFloat.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/PostOrderIterator.h"
 #include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringSwitch.h"
+#include "llvm/Analysis/VectorUtils.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Constants.h"
+#include "llvm/IR/DiagnosticHandler.h"
 #include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/Function.h"
+#include "llvm/IR/CFG.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/LegacyPassManager.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/PassManager.h"
 #include "llvm/IR/Type.h"
 #include "llvm/IR/Verifier.h"
+#include "llvm/Passes/OptimizationLevel.h"
 #include "llvm/Passes/PassBuilder.h"
 #include "llvm/Passes/StandardInstrumentations.h"
 #include "llvm/Support/TargetSelect.h"
@@ -20,25 +34,51 @@
 #include "llvm/Transforms/Scalar/GVN.h"
 #include "llvm/Transforms/Scalar/Reassociate.h"
 #include "llvm/Transforms/Scalar/SimplifyCFG.h"
+#include "llvm/Transforms/Scalar/TailRecursionElimination.h"
+#include "llvm/Transforms/Utils/Mem2Reg.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
 #include "llvm/Support/Error.h" 
+#include "llvm/ExecutionEngine/ObjectCache.h"
+#include "llvm/ExecutionEngine/Orc/CompileUtils.h"
+#include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
 #include "llvm/ExecutionEngine/Orc/LLJIT.h"
 #include "llvm/Support/DynamicLibrary.h"
+#include "llvm/Support/Allocator.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/FileUtilities.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Program.h"
+#include "llvm/Support/Regex.h"
+#include "llvm/Support/SHA1.h"
 // END LLVM INCLUDES
 
 // C++ INCLUDES
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cctype>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <deque>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <random>
 #include <string>
+#include <thread>
 #include <vector>
 #include <iostream> 
 // END C++ INCLUDES
 
+#include "basiclang.h"
+
 // BEGIN TOKEN ENUMERATION
 enum Token {
  tok_eof = -1,
@@ -47,6 +87,13 @@ enum Token {
 
  tok_identifier = -4,
  tok_number = -5,
+
+ tok_for = -6,
+ tok_in = -7,
+
+ tok_if = -8,
+ tok_then = -9,
+ tok_else = -10,
 };
 // END TOKEN ENUMERATION
 
@@ -56,27 +103,414 @@ class NumberExprAST;
 class VariableExprAST;
 class BinaryExprAST;
 class CallExprAST;
+class IndexExprAST;
+class ForExprAST;
+class IfExprAST;
 class PrototypeAST;
 class FunctionAST;
+class ASTSimplifier;
 // END AST FORWARD DECLARATIONS
 
+// BEGIN SYMBOLS
+/*
+  Every identifier is interned by the lexer into a Symbol, a small integer that is
+  the same for every occurrence of the same spelling for the life of the process.
+  The AST stores Symbols instead of names, and the codegen tables (NamedValues,
+  FunctionProtos) are dense vectors indexed by them, so a variable reference or a
+  call costs an array access instead of a string compare or hash.
+
+  Keywords and builtin names are interned first, in the order of PredefinedSymbol,
+  so the lexer and codegen recognize them by comparing IDs.
+*/
+using Symbol = unsigned;
+
+enum PredefinedSymbol : Symbol {
+  Sym_fn, Sym_incl, Sym_for, Sym_in, Sym_if, Sym_then, Sym_else, // keywords
+  Sym_array, Sym_len, Sym_map, Sym_reduce, Sym_dot, Sym_sum, Sym_pfor, // builtins
+  Sym_binary, // 'fn binary| 5 (a b)' defines an operator
+  NumPredefinedSymbols,
+  NumKeywordSymbols = Sym_array,
+};
+
+class SymbolTable {
+private:
+  // [1st] ID of each spelling. The StringMap owns the characters, entries never move.
+  // [2nd] Spelling of each ID, a view of the key in IDs.
+
+  llvm::StringMap<Symbol> IDs; // [1st]
+
+  std::vector<llvm::StringRef> Names; // [2nd]
+
+public:
+  SymbolTable() {
+    for (const char *Name : {"fn", "incl", "for", "in", "if", "then", "else",
+                             "array", "len", "map", "reduce", "dot", "sum", "pfor", "binary"}) {
+      intern(Name);
+    }
+    assert(Names.size() == NumPredefinedSymbols && "PredefinedSymbol out of sync");
+  }
+
+  // * Returns the ID of Name, assigning the next free one on first sight.
+  Symbol intern(llvm::StringRef Name) {
+    auto Inserted = IDs.try_emplace(Name, static_cast<Symbol>(Names.size()));
+    if (Inserted.second) {
+      Names.push_back(Inserted.first->getKey());
+    }
+    return Inserted.first->getValue();
+  }
+
+  llvm::StringRef getName(Symbol S) const { return Names[S]; }
+  size_t size() const { return Names.size(); }
+};
+
+static thread_local SymbolTable Symbols; // one per Compiler, see LIBRARY API
+
+// * Dense map from Symbol to T, T() for symbols that were never set.
+template <typename T> class SymbolMap {
+private:
+  std::vector<T> Values;
+
+public:
+  const T &lookup(Symbol S) const {
+    static const T None{};
+    return S < Values.size() ? Values[S] : None;
+  }
+
+  T &operator[](Symbol S) {
+    if (S >= Values.size()) {
+      Values.resize(std::max<size_t>(S + 1, Symbols.size())); // room for symbols seen so far
+    }
+    return Values[S];
+  }
+};
+
+// * Stack slots of the locals in scope. Every binding is logged, so a scope (loop
+//   body, if branch, function) is left by undoing the bindings made since its
+//   mark(), in time proportional to what the scope declared, not to the table size.
+class ScopeTable {
+private:
+  SymbolMap<llvm::AllocaInst *> Slots;
+  std::vector<std::pair<Symbol, llvm::AllocaInst *>> Undo; // symbol and its previous slot
+
+public:
+  llvm::AllocaInst *lookup(Symbol S) const { return Slots.lookup(S); }
+
+  void bind(Symbol S, llvm::AllocaInst *A) {
+    llvm::AllocaInst *&Slot = Slots[S];
+    Undo.emplace_back(S, Slot);
+    Slot = A;
+  }
+
+  size_t mark() const { return Undo.size(); }
+
+  void restore(size_t Mark) {
+    while (Undo.size() > Mark) {
+      Slots[Undo.back().first] = Undo.back().second;
+      Undo.pop_back();
+    }
+  }
+
+  void clear() { restore(0); }
+};
+// END SYMBOLS
+
+// BEGIN OPERATORS
+/*
+  Binary operator precedence, indexed by the operator character (a token below 256).
+  0 means "not an operator". The builtin operators are fixed at compile time;
+  'fn binary<c> <prec> (a b) ...' adds <c> with its precedence at runtime, and a
+  use of it becomes an always-inlined call of the function 'binary<c>'.
+*/
+struct PrecedenceTable {
+  int Prec[256];
+};
+
+static constexpr PrecedenceTable makeBuiltinPrecedence() {
+  PrecedenceTable T{};
+  T.Prec[':'] = 1;  // Sequencing, binds loosest
+  T.Prec['<'] = 10;
+  T.Prec['+'] = 20;
+  T.Prec['-'] = 20; // Same precedence as +
+  T.Prec['*'] = 40; // Higher precedence
+  return T;
+}
+
+static constexpr PrecedenceTable BuiltinPrecedence = makeBuiltinPrecedence();
+static thread_local PrecedenceTable BinopPrecedence = BuiltinPrecedence;
+static thread_local Symbol BinopFunctions[256] = {}; // function of each user-defined operator, 0 if none
+static const unsigned DefaultUserBinopPrecedence = 30;
+
+static bool isBuiltinBinop(char Op) { return BuiltinPrecedence.Prec[static_cast<unsigned char>(Op)] > 0; }
+
+// * Characters that may name a user-defined operator: punctuation that isn't already
+//   taken by the builtin operators or the rest of the syntax.
+static bool isUserBinopChar(int C) {
+  return C > 0 && C < 128 && std::ispunct(C) && !isBuiltinBinop(static_cast<char>(C)) &&
+         !std::strchr("()[],;=#.", C);
+}
+// END OPERATORS
+
 // BEGIN LLVM CONTEXT
-static std::unique_ptr<llvm::LLVMContext> TheContext;
-static std::unique_ptr<llvm::Module> TheModule;
-static std::unique_ptr<llvm::IRBuilder<>> Builder;
-static std::unique_ptr<llvm::orc::LLJIT> TheJIT;
-static std::unique_ptr<llvm::FunctionPassManager> TheFPM;
-static std::unique_ptr<llvm::LoopAnalysisManager> TheLAM;
-static std::unique_ptr<llvm::FunctionAnalysisManager> TheFAM;
-static std::unique_ptr<llvm::CGSCCAnalysisManager> TheCGAM;
-static std::unique_ptr<llvm::ModuleAnalysisManager> TheMAM;
-static std::unique_ptr<llvm::PassInstrumentationCallbacks> ThePIC;
-static std::unique_ptr<llvm::StandardInstrumentations> TheSI;
-static std::map<std::string, std::unique_ptr<PrototypeAST>> FunctionProtos;
-static std::map<std::string, llvm::Value *> NamedValues;
+// The compiler state is thread_local: the program's own state lives on the main
+// thread, and every basiclang::Compiler swaps its copy in while it is working (see
+// LIBRARY API), so compilers on different threads don't share anything.
+static thread_local llvm::orc::ThreadSafeContext TheTSC;    // shared by the modules handed to the JIT
+static thread_local llvm::LLVMContext *TheContext = nullptr; // TheTSC's context
+static thread_local unsigned ModulesInContext = 0;           // modules created in TheTSC so far
+static constexpr unsigned ModulesPerContext = 256;
+static thread_local std::unique_ptr<llvm::Module> TheModule;
+static thread_local std::unique_ptr<llvm::IRBuilder<>> Builder;
+static thread_local std::unique_ptr<llvm::orc::LLJIT> TheJIT;
+static thread_local std::unique_ptr<llvm::TargetMachine> TheTM; // same CPU/features as the JIT's, used for tuning
+static thread_local std::unique_ptr<llvm::FunctionPassManager> TheFPM;
+static thread_local std::unique_ptr<llvm::LoopAnalysisManager> TheLAM;
+static thread_local std::unique_ptr<llvm::FunctionAnalysisManager> TheFAM;
+static thread_local std::unique_ptr<llvm::CGSCCAnalysisManager> TheCGAM;
+static thread_local std::unique_ptr<llvm::ModuleAnalysisManager> TheMAM;
+static thread_local std::unique_ptr<llvm::PassInstrumentationCallbacks> ThePIC;
+static thread_local std::unique_ptr<llvm::StandardInstrumentations> TheSI;
+static thread_local SymbolMap<std::unique_ptr<PrototypeAST>> FunctionProtos; // declared with 'incl'
+static thread_local SymbolMap<std::unique_ptr<PrototypeAST>> DefinedProtos;  // defined at the REPL
+static thread_local ScopeTable NamedValues; // stack slot of each local
+static thread_local llvm::raw_ostream *ErrorStream = nullptr; // compile errors, stderr if null
+static thread_local unsigned OptLevel = 2; // -O0 .. -O3
+static thread_local llvm::FastMathFlags GlobalFMF; // --fast-math / --fp-contract=fast
 static llvm::ExitOnError ExitOnErr;
+static std::string RemarksFilter;     // --remarks=<regex>
+static unsigned PforThreads = 0;      // --threads=N, 0 = one per hardware thread
+static bool SimplifyAST = true;       // --no-simplify turns the AST rewrite off
+static size_t MemoCapacity = 1 << 16; // --memo-size=N, entries per 'memo' function
+
+static llvm::raw_ostream &errorStream() { return ErrorStream ? *ErrorStream : llvm::errs(); }
 // END LLVM CONTEXT
 
+// BEGIN COMPILE STATS
+/*
+  --stats=out.json records where compile time goes. Wall time is split into phases
+  that don't overlap: a phase entered inside another (lexing while parsing, the
+  per-function passes inside codegen) pauses the outer one, so the phase times add
+  up to the compile time. 'jit' is what remains of handing modules to the JIT and
+  looking up their symbols once the module pipeline ('optimize') is taken out,
+  i.e. machine code generation and linking. Optimization time is further broken
+  down per pass through the pass instrumentation, again exclusive of nested passes.
+*/
+class CompileStats {
+public:
+  enum Phase : unsigned { Idle, Lex, Parse, ASTPasses, Codegen, Optimize, JIT, NumPhases };
+
+  bool Enabled = false;
+  uint64_t Tokens = 0, ASTNodes = 0, IRInstructions = 0, JITModules = 0;
+
+private:
+  using Clock = std::chrono::steady_clock;
+
+  struct PassTime {
+    uint64_t Runs = 0;
+    double Seconds = 0;
+  };
+
+  // [1st] Time per phase, and the phase the clock is currently running for.
+  // [2nd] Time per pass name, and the passes currently running, innermost last.
+
+  double PhaseSeconds[NumPhases] = {}; // [1st]
+  Phase Current = Idle;
+  Clock::time_point Since = Clock::now();
+
+  llvm::StringMap<PassTime> Passes; // [2nd]
+  std::vector<std::pair<PassTime *, Clock::time_point>> PassStack;
+
+  Clock::time_point Start = Clock::now();
+
+  void stopPass(Clock::time_point Now) {
+    PassStack.back().first->Seconds +=
+        std::chrono::duration<double>(Now - PassStack.back().second).count();
+  }
+
+public:
+  // * Charges the time since the last switch to the current phase and switches to
+  //   P. Returns the phase to switch back to.
+  Phase enter(Phase P) {
+    Clock::time_point Now = Clock::now();
+    PhaseSeconds[Current] += std::chrono::duration<double>(Now - Since).count();
+    Since = Now;
+    std::swap(Current, P);
+    return P;
+  }
+
+  // * Times every pass run by pass managers built with PIC.
+  void registerCallbacks(llvm::PassInstrumentationCallbacks &PIC) {
+    static const std::vector<llvm::StringRef> Containers = {"PassManager", "PassAdaptor",
+                                                            "AnalysisManagerProxy", "DevirtSCCRepeatedPass",
+                                                            "ModuleInlinerWrapperPass"};
+    PIC.registerBeforeNonSkippedPassCallback([this](llvm::StringRef Pass, llvm::Any) {
+      if (llvm::isSpecialPass(Pass, Containers)) {
+        return;
+      }
+      Clock::time_point Now = Clock::now();
+      if (!PassStack.empty()) {
+        stopPass(Now);
+      }
+      PassTime &T = Passes[Pass];
+      ++T.Runs;
+      PassStack.emplace_back(&T, Now);
+    });
+    auto After = [this](llvm::StringRef Pass) {
+      if (llvm::isSpecialPass(Pass, Containers) || PassStack.empty()) {
+        return;
+      }
+      Clock::time_point Now = Clock::now();
+      stopPass(Now);
+      PassStack.pop_back();
+      if (!PassStack.empty()) {
+        PassStack.back().second = Now;
+      }
+    };
+    PIC.registerAfterPassCallback(
+        [After](llvm::StringRef Pass, llvm::Any, const llvm::PreservedAnalyses &) { After(Pass); });
+    PIC.registerAfterPassInvalidatedCallback(
+        [After](llvm::StringRef Pass, const llvm::PreservedAnalyses &) { After(Pass); });
+  }
+
+  // * Writes everything recorded so far to Path as JSON, returns false on failure.
+  bool write(llvm::StringRef Path) {
+    enter(Current); // bring the current phase up to date
+    std::error_code EC;
+    llvm::raw_fd_ostream OS(Path, EC);
+    if (EC) {
+      llvm::errs() << "Error: can't write " << Path << ": " << EC.message() << '\n';
+      return false;
+    }
+
+    std::vector<std::pair<llvm::StringRef, PassTime>> ByTime;
+    for (const auto &P : Passes) {
+      ByTime.emplace_back(P.getKey(), P.getValue());
+    }
+    std::sort(ByTime.begin(), ByTime.end(),
+              [](const auto &A, const auto &B) { return A.second.Seconds > B.second.Seconds; });
+
+    static const char *PhaseNames[NumPhases] = {"other", "lex", "parse", "ast_passes",
+                                                "codegen", "optimize", "jit"};
+    llvm::json::OStream J(OS, /*IndentSize=*/2);
+    J.object([&] {
+      J.attribute("total_seconds", std::chrono::duration<double>(Clock::now() - Start).count());
+      J.attributeObject("phases", [&] {
+        for (unsigned P = Lex; P < NumPhases; ++P) {
+          J.attribute(PhaseNames[P], PhaseSeconds[P]);
+        }
+      });
+      J.attributeObject("counters", [&] {
+        J.attribute("tokens", static_cast<int64_t>(Tokens));
+        J.attribute("ast_nodes", static_cast<int64_t>(ASTNodes));
+        J.attribute("ir_instructions", static_cast<int64_t>(IRInstructions));
+        J.attribute("jit_modules", static_cast<int64_t>(JITModules));
+      });
+      J.attributeArray("passes", [&] {
+        for (const auto &P : ByTime) {
+          J.object([&] {
+            J.attribute("name", P.first);
+            J.attribute("runs", static_cast<int64_t>(P.second.Runs));
+            J.attribute("seconds", P.second.Seconds);
+          });
+        }
+      });
+    });
+    OS << '\n';
+    return true;
+  }
+};
+
+static thread_local CompileStats Stats; // the main thread's is written by --stats
+
+// * Attributes the time until the end of the scope to a phase, when --stats is on.
+class PhaseTimer {
+private:
+  CompileStats::Phase Prev = CompileStats::Idle;
+
+public:
+  PhaseTimer(CompileStats::Phase P) {
+    if (Stats.Enabled) {
+      Prev = Stats.enter(P);
+    }
+  }
+  ~PhaseTimer() {
+    if (Stats.Enabled) {
+      Stats.enter(Prev);
+    }
+  }
+};
+// END COMPILE STATS
+
+// BEGIN AST ARENA
+/*
+  Every node of a top-level item (one 'fn', 'incl' or top-level expression) is
+  bump-allocated out of the parser's arena and released in one go once the item
+  has been code generated. Nodes therefore must not own heap memory themselves:
+  names are interned Symbols, child lists are copied into the arena as
+  llvm::ArrayRef, and node destructors are never run.
+*/
+class ASTArena {
+private:
+  // [1st] Backing storage, slabs are kept around across reset() and reused.
+  // [2nd] Nodes allocated one by one with operator new, only used when UseHeap is set
+  //       so --bench-parse can compare against per-node heap allocation.
+  // [3rd] Number of nodes handed out since the last reset().
+
+  llvm::BumpPtrAllocator Alloc; // [1st]
+
+  std::vector<void *> HeapAllocs; // [2nd]
+  bool UseHeap = false;
+
+  size_t NodeCount = 0; // [3rd]
+
+  void *allocate(size_t Size, size_t Align) {
+    if (UseHeap) {
+      HeapAllocs.push_back(::operator new(Size));
+      return HeapAllocs.back();
+    }
+    return Alloc.Allocate(Size, llvm::Align(Align));
+  }
+
+public:
+  // [1st] * Constructs a node of type T in the arena.
+  // [2nd] * Copies a string / array into the arena and returns a view of the copy.
+  // [3rd] * Frees every node of the current item at once.
+
+  template <typename T, typename... ArgTs> T *make(ArgTs &&...Args) { // [1st]
+    ++NodeCount;
+    return new (allocate(sizeof(T), alignof(T))) T(std::forward<ArgTs>(Args)...);
+  }
+
+  llvm::StringRef copyString(llvm::StringRef Str) { // [2nd]
+    if (Str.empty())
+      return llvm::StringRef();
+    char *Mem = static_cast<char *>(allocate(Str.size(), 1));
+    std::memcpy(Mem, Str.data(), Str.size());
+    return llvm::StringRef(Mem, Str.size());
+  }
+
+  template <typename T> llvm::ArrayRef<T> copyArray(llvm::ArrayRef<T> Arr) {
+    if (Arr.empty())
+      return llvm::ArrayRef<T>();
+    T *Mem = static_cast<T *>(allocate(sizeof(T) * Arr.size(), alignof(T)));
+    std::uninitialized_copy(Arr.begin(), Arr.end(), Mem);
+    return llvm::ArrayRef<T>(Mem, Arr.size());
+  }
+
+  void reset() { // [3rd]
+    for (void *P : HeapAllocs)
+      ::operator delete(P);
+    HeapAllocs.clear();
+    Alloc.Reset();
+    NodeCount = 0;
+  }
+
+  void setUseHeap(bool Heap) { UseHeap = Heap; }
+  size_t getNodeCount() const { return NodeCount; }
+
+  ~ASTArena() { reset(); }
+};
+// END AST ARENA
+
 
 // ---------------------------------BEGIN AST DEFINITION ------------------------------------------
 
@@ -91,10 +525,13 @@ static llvm::ExitOnError ExitOnErr;
 struct ExprAST {
   // [1st] * LLVM Code generation, inherited by derived classes.
   // [2nd] Virtual destructor to ensure proper cleanup of derived classes.
+  // [3rd] * Returns a simplified equivalent of this node (possibly itself), see ASTSimplifier.
     
   virtual ~ExprAST() = default; // [1st]
 
   virtual llvm::Value *codegen() = 0; // [2nd]
+
+  virtual ExprAST *simplify(ASTSimplifier &S) { return this; } // [3rd]
 }; 
 // FOLLOWING CLASSES USE EXPRAST: class foobar : public ExprAST { body }; 
 
@@ -108,10 +545,13 @@ class NumberExprAST : public ExprAST {
   public:
     // [1st] Constructor for NumberExprAST, initializes the value.
     // [2nd] * LLVM Code Generation function for NumberExprAST.
+    // [3rd] * Getter for the value.
     
     NumberExprAST(double Val) : Val(Val) {} // [1st]
 
     llvm::Value *codegen() override; // [2nd]
+
+    double getVal() const { return Val; } // [3rd]
 };
 
 // * VariableExprAST AST Nodes.
@@ -119,17 +559,18 @@ class VariableExprAST : public ExprAST {
 private:
   // [1st] Holds the name of the variable.
 
-  std::string Name; // [1st]
+  Symbol Name; // [1st]
 
 public:
   // [1st] Constructor for VariableExprAST, initializes the variable name. 
-  // [2nd] * Getter function for variable name.
+  // [2nd] * Getter functions for the variable name and its spelling.
   // [3rd] * LLVM Code Generation function for VariableExprAST.
 
 
-  VariableExprAST(const std::string& Name) : Name(Name) {} // [1st]
+  VariableExprAST(Symbol Name) : Name(Name) {} // [1st]
 
-  const std::string &getName() const { return Name; } // [2nd]
+  Symbol getSymbol() const { return Name; } // [2nd]
+  llvm::StringRef getName() const { return Symbols.getName(Name); }
   
   llvm::Value *codegen() override; // [3rd]
 };
@@ -143,634 +584,4118 @@ private:
   
   char Op; // [1st]
 
-  std::unique_ptr<ExprAST> LHS, RHS; // [2nd]
+  ExprAST *LHS, *RHS; // [2nd]
 
 public:
   // [1st] Constructor for BinaryExprAST, initializes the operator and the two expressions.
-  //       Owner uses std::move to transfer. [IMPORTANT]
+  //       Both operands live in the same ASTArena as this node. [IMPORTANT]
   // [2nd] * LLVM Code Generation function for BinaryExprAST.
+  // [3rd] * Getter for the operator.
 
-  BinaryExprAST(char Op, std::unique_ptr<ExprAST> LHS, std::unique_ptr<ExprAST> RHS)
-      : Op(Op), LHS(std::move(LHS)), RHS(std::move(RHS)) {} // [1st]
+  BinaryExprAST(char Op, ExprAST *LHS, ExprAST *RHS)
+      : Op(Op), LHS(LHS), RHS(RHS) {} // [1st]
 
   llvm::Value *codegen() override; // [2nd]
+  ExprAST *simplify(ASTSimplifier &S) override;
+
+  char getOp() const { return Op; } // [3rd]
+  ExprAST *getLHS() const { return LHS; }
+  ExprAST *getRHS() const { return RHS; }
+  void getOperands(ExprAST *&Y, NumberExprAST *&C) const;
 };
 
 // * CallExprAST represents a function call expression
 class CallExprAST : public ExprAST {
 private:
   // [1st] Holds callee name (function name).
-  // [2nd] Holds arguments for the function call.
+  // [2nd] Holds arguments for the function call, the array is copied into the arena.
 
-  std::string Callee; // [1st]
+  Symbol Callee; // [1st]
 
-  std::vector<std::unique_ptr<ExprAST>> Args; // [2nd]
+  llvm::ArrayRef<ExprAST *> Args; // [2nd]
  
  public:
     // [1st] Constructor for CallExprAST
     // [2nd] * LLVM Code generation function.
+    // [3rd] * Getters for the callee and its name.
 
-   CallExprAST(const std::string& Callee, std::vector<std::unique_ptr<ExprAST>> Args)
-       : Callee(Callee), Args(std::move(Args)) {} // [1st]
+   CallExprAST(Symbol Callee, llvm::ArrayRef<ExprAST *> Args)
+       : Callee(Callee), Args(Args) {} // [1st]
 
    llvm::Value *codegen() override; // [2nd]
+   ExprAST *simplify(ASTSimplifier &S) override;
+
+   Symbol getCallee() const { return Callee; } // [3rd]
+   llvm::StringRef getCalleeName() const { return Symbols.getName(Callee); }
+   llvm::ArrayRef<ExprAST *> getArgs() const { return Args; }
 };
 
+// * Function attributes, written between 'fn' and the function name:
+//   fn fastmath poly(x) ...
+enum FunctionAttr : unsigned {
+  FnAttr_None = 0,
+  FnAttr_FastMath = 1 << 0, // all fast-math flags on the body's FP operations
+  FnAttr_Memo = 1 << 1,     // results cached by argument values, see EmitMemoLookup
+};
+
+static FunctionAttr lookupFunctionAttr(llvm::StringRef Name) {
+  return llvm::StringSwitch<FunctionAttr>(Name)
+      .Case("fastmath", FnAttr_FastMath)
+      .Case("memo", FnAttr_Memo)
+      .Default(FnAttr_None);
+}
+
 // * PrototypeAST represents a function prototype
 class PrototypeAST {
 private:
   // [1st] Holds the name of the function.
-  // [2nd] Holds the argument names for the function prototype.
+  // [2nd] Holds the argument names for the function prototype, and which of them
+  //       are arrays ('xs[]'). ArrayArgs may be empty when all arguments are numbers.
+  // [3rd] FunctionAttr bits given in the definition.
+  // [4th] Operator character and precedence of 'binary<c>' functions, 0 otherwise.
+  // [5th] Whether the definition got SIMD variants (see VECTOR VARIANTS), which
+  //       declarations of it in later modules then declare as well.
 
-  std::string Name; // [1st]
+  Symbol Name; // [1st]
 
-  std::vector<std::string> Args; // [2nd]
+  std::vector<Symbol> Args; // [2nd]
+  std::vector<bool> ArrayArgs;
+
+  unsigned Attrs; // [3rd]
+
+  char BinaryOp; // [4th]
+  unsigned Precedence;
+
+  bool VectorVariants = false; // [5th]
 
 public:
   // [1st] Constructor for PrototypeAST, initializes the function name and arguments.
-  // [2nd] * Getter function for the function name.
+  // [2nd] * Getter functions for the function name, attributes and operator.
   // [3rd] * LLVM Code generation function for PrototypeAST.
 
-  PrototypeAST(const std::string &Name, std::vector<std::string> Args)
-      : Name(Name), Args(std::move(Args)) {} // [1st]
+  PrototypeAST(Symbol Name, std::vector<Symbol> Args,
+               unsigned Attrs = FnAttr_None, std::vector<bool> ArrayArgs = {},
+               char BinaryOp = 0, unsigned Precedence = 0)
+      : Name(Name), Args(std::move(Args)), ArrayArgs(std::move(ArrayArgs)), Attrs(Attrs),
+        BinaryOp(BinaryOp), Precedence(Precedence) {} // [1st]
 
-  const std::string &getName() const { return Name; } // [2nd]
+  Symbol getSymbol() const { return Name; } // [2nd]
+  llvm::StringRef getName() const { return Symbols.getName(Name); }
+  bool hasAttr(FunctionAttr A) const { return Attrs & A; }
+  bool isBinaryOp() const { return BinaryOp != 0; }
+  char getOperator() const { return BinaryOp; }
+  unsigned getBinaryPrecedence() const { return Precedence; }
+  llvm::ArrayRef<Symbol> getArgs() const { return Args; }
+  bool isArrayArg(unsigned i) const { return i < ArrayArgs.size() && ArrayArgs[i]; }
+  bool hasVectorVariants() const { return VectorVariants; }
+  void setVectorVariants() { VectorVariants = true; }
 
   llvm::Function *codegen(); // [3rd]
 };
 
 class FunctionAST {
 private:
-  // [1st] Holds the function prototype.
-  // [2nd] Holds the function body (expression).
+  // [1st] Holds the function prototype. Prototypes may outlive the item (see
+  //       FunctionProtos), so they stay on the heap.
+  // [2nd] Holds the function body (expression), owned by the parser's arena.
 
   std::unique_ptr<PrototypeAST> Proto; // [1st]
 
-  std::unique_ptr<ExprAST> Body; // [2nd]
+  ExprAST *Body; // [2nd]
  
 public:
   // [1st] Constructor for FunctionAST, initializes the prototype and body.
-  // [2nd] * LLVM Code generation function for FunctionAST.
-  // [3rd] * Getter function for the prototype.
+  // [2nd] * LLVM Code generation function for FunctionAST, and the AST rewrite
+  //         run on the body just before it.
+  // [3rd] * Getter functions for the prototype and body.
 
-  FunctionAST(std::unique_ptr<PrototypeAST> Proto,
-              std::unique_ptr<ExprAST> Body)
-      : Proto(std::move(Proto)), Body(std::move(Body)) {} // [1st]
+  FunctionAST(std::unique_ptr<PrototypeAST> Proto, ExprAST *Body)
+      : Proto(std::move(Proto)), Body(Body) {} // [1st]
 
   llvm::Function *codegen(); // [2nd]
+  void simplify(ASTSimplifier &S);
   const PrototypeAST *getProto() const { return Proto.get(); } // [3rd]
+  std::unique_ptr<PrototypeAST> takeProto() { return std::move(Proto); }
+  ExprAST *getBody() const { return Body; }
+};
+
+// * IndexExprAST represents reading an array element: xs[i]
+class IndexExprAST : public ExprAST {
+private:
+  // [1st] Holds the name of the array variable.
+  // [2nd] Holds the index expression.
+
+  Symbol Name; // [1st]
+
+  ExprAST *Index; // [2nd]
+
+public:
+  // [1st] Constructor for IndexExprAST.
+  // [2nd] * Getters for the array name and index.
+  // [3rd] * LLVM Code generation function for IndexExprAST.
+
+  IndexExprAST(Symbol Name, ExprAST *Index) : Name(Name), Index(Index) {} // [1st]
+
+  Symbol getSymbol() const { return Name; } // [2nd]
+  ExprAST *getIndex() const { return Index; }
+
+  llvm::Value *codegen() override; // [3rd]
+  ExprAST *simplify(ASTSimplifier &S) override;
 };
 
 class AssignExprAST : public ExprAST {
 private:
   // [1st] Holds the variable name for assignment.
   // [2nd] Holds the expression to assign to the variable.
+  // [3rd] Holds the element index for 'xs[i] = v', nullptr for a plain variable.
   
-  std::string VarName; // [1st]
+  Symbol VarName; // [1st]
 
-  std::unique_ptr<ExprAST> Expr; // [2nd]
+  ExprAST *Expr; // [2nd]
+
+  ExprAST *Index; // [3rd]
 public:
   // [1st] Constructor for AssignExprAST, initializes the variable name and expression.
   // [2nd] * Getter function for the variable name.
   // [3rd] * LLVM Code generation function for AssignExprAST.
 
-  AssignExprAST(const std::string &VarName, std::unique_ptr<ExprAST> Expr)
-      : VarName(VarName), Expr(std::move(Expr)) {} // [1st]
+  AssignExprAST(Symbol VarName, ExprAST *Expr, ExprAST *Index = nullptr)
+      : VarName(VarName), Expr(Expr), Index(Index) {} // [1st]
 
-  const std::string &getName() const { return VarName; } // [2nd]
+  Symbol getSymbol() const { return VarName; } // [2nd]
 
   llvm::Value *codegen() override; // [3rd]
+  ExprAST *simplify(ASTSimplifier &S) override;
 };
 
-// -------------------------------------END AST DEFINITION ------------------------------------------
+// * ForExprAST represents a counted loop: for i = start, end, step in body
+//   i runs from start while it is below end (above end for a negative step),
+//   step defaults to 1. The loop itself evaluates to 0.
+class ForExprAST : public ExprAST {
+private:
+  // [1st] Holds the name of the induction variable.
+  // [2nd] Holds start value, end bound, step (nullptr if omitted) and body.
 
-// * LLVM ERROR HANDLING
-llvm::Value *LogErrorV(const char *Str) {
- llvm::errs() << "LLVM Error: " << Str << '\n';
- return nullptr;
-}
-// * END LLVM ERROR HANDLING
+  Symbol VarName; // [1st]
 
-// ---------------------------------BEGIN CODEGEN IMPLEMENTATIONS--------------------------------
-llvm::Value *NumberExprAST::codegen() {
- return llvm::ConstantFP::get(*TheContext, llvm::APFloat(Val));
-}
-llvm::Value *VariableExprAST::codegen() {
- llvm::Value *V = NamedValues[Name];
- if (!V) {
-   return LogErrorV("Unknown variable name");
- }
- return V;
-}
+  ExprAST *Start, *End, *Step, *Body; // [2nd]
 
-llvm::Value *BinaryExprAST::codegen() {
- llvm::Value *L = LHS->codegen();
- llvm::Value *R = RHS->codegen();
- if(!L || !R) {
-   return nullptr;
- }
+public:
+  // [1st] Constructor for ForExprAST, all children live in the same ASTArena.
+  // [2nd] * LLVM Code generation function for ForExprAST.
 
- switch (Op) {
-   case '+' :
-     return Builder->CreateFAdd(L, R, "addtmp");
-   case '-':
-     return Builder->CreateFSub(L, R, "subtmp");
-   case '*':
-     return Builder->CreateFMul(L, R, "multmp");
-   case '<':
-     L = Builder->CreateFCmpULT(L, R, "cmptmp");
-     return Builder->CreateUIToFP(L, llvm::Type::getDoubleTy(*TheContext), "booltmp");
-   default:
-     return LogErrorV("invalid binary operator");
- }
-}
-llvm::Value *AssignExprAST::codegen() {
- llvm::Value *Val = Expr->codegen();
- if (!Val)
-   return nullptr;
- NamedValues[VarName] = Val;
- return Val;
-}
-llvm::Value *CallExprAST::codegen() {
- // Look up the name in the global module table.
- llvm::Function *CalleeF = TheModule->getFunction(Callee);
- if (!CalleeF) {
-   // If not, check if it's a known prototype.
-   auto FI = FunctionProtos.find(Callee);
-   if (FI != FunctionProtos.end()) {
-       CalleeF = FI->second->codegen();
-   } else {
-       return LogErrorV("Unknown Function Referenced");
-   }
- }
+  ForExprAST(Symbol VarName, ExprAST *Start, ExprAST *End, ExprAST *Step, ExprAST *Body)
+      : VarName(VarName), Start(Start), End(End), Step(Step), Body(Body) {} // [1st]
 
- if (CalleeF->arg_size() != Args.size()) {
-   return LogErrorV("Incorrect # args passed");
- }
- std::vector<llvm::Value*> ArgsV;
- for (unsigned i {0}, e = Args.size(); i != e; ++i) {
-   ArgsV.push_back(Args[i]->codegen());
-   if(!ArgsV.back()) {
-     return nullptr;
-   }
- }
- return Builder->CreateCall(CalleeF, ArgsV, "calltmp");
-}
+  llvm::Value *codegen() override; // [2nd]
+  ExprAST *simplify(ASTSimplifier &S) override;
+};
 
-llvm::Function *PrototypeAST::codegen() {
- std::vector<llvm::Type *> Doubles(Args.size(), llvm::Type::getDoubleTy(*TheContext));
- llvm::FunctionType *FT = llvm::FunctionType::get(llvm::Type::getDoubleTy(*TheContext), Doubles, false);
+// * IfExprAST represents a conditional: if cond then a else b
+//   cond is true when it is not 0. Only the chosen branch is evaluated.
+class IfExprAST : public ExprAST {
+private:
+  // [1st] Holds the condition and both branches, all in the same ASTArena.
 
- llvm::Function *F = llvm::Function::Create(FT, llvm::Function::ExternalLinkage, Name, TheModule.get());
- unsigned idx = 0;
- for (auto &Arg : F->args()) {
-   Arg.setName(Args[idx++]);
- }
- return F;
-}
- 
-llvm::Function *FunctionAST::codegen() {
- llvm::Function *TheFunction = TheModule->getFunction(Proto->getName());
+  ExprAST *Cond, *Then, *Else; // [1st]
 
- if(!TheFunction) {
-   TheFunction = Proto->codegen();
- }
- 
- if(!TheFunction) {
-   return nullptr;
- }
- 
- llvm::BasicBlock *BB = llvm::BasicBlock::Create(*TheContext, "entry", TheFunction);
- Builder->SetInsertPoint(BB);
+public:
+  // [1st] Constructor for IfExprAST.
+  // [2nd] * LLVM Code generation function for IfExprAST.
+  // [3rd] * Getters for the condition and branches.
 
- NamedValues.clear();
- for (auto &Arg : TheFunction->args()) {
-   NamedValues[std::string(Arg.getName())] = &Arg;
- }
- if (llvm::Value *RetVal = Body->codegen()) {
-   Builder->CreateRet(RetVal);
+  IfExprAST(ExprAST *Cond, ExprAST *Then, ExprAST *Else)
+      : Cond(Cond), Then(Then), Else(Else) {} // [1st]
 
-   llvm::verifyFunction(*TheFunction);
-   
-   // Run the optimizer on the function.
-   if (TheFPM) {
-       TheFPM->run(*TheFunction, *TheFAM);
-   }
+  llvm::Value *codegen() override; // [2nd]
+  ExprAST *simplify(ASTSimplifier &S) override;
 
-   return TheFunction;
- }
- // Error reading body, remove function.
- TheFunction->eraseFromParent();
- return nullptr;
-}
+  ExprAST *getCond() const { return Cond; } // [3rd]
+  ExprAST *getThen() const { return Then; }
+  ExprAST *getElse() const { return Else; }
+};
 
-struct lexer {
-   std::string IdentifierStr;
-   double NumVal;
-   int CurTok;
-   int LastChar;
+// -------------------------------------END AST DEFINITION ------------------------------------------
 
-   lexer() : CurTok(0), LastChar(' ') {} // Initialize CurTok
-   int gettok() {
-       while (isspace(LastChar)) { LastChar = getchar(); }
+// BEGIN AST SIMPLIFIER
+/*
+  Rewrites a function body before codegen so less IR reaches LLVM:
 
-     if (isalpha(LastChar)) { 
-       IdentifierStr.clear();
-       IdentifierStr += static_cast<char>(LastChar);
+    constant folding      2*3*x    -> 6*x,  1 < 2 -> 1
+    identities            x*1, 1*x, x-0 -> x,  3 : e -> e
+    with 'fastmath' / --fast-math only (no signed zeros, reassociation):
+                          x+0, 0+x -> x,  (x*2)*3 -> x*6,  (x+1)+2 -> x+3
 
-       while(isalnum((LastChar = getchar()))) { // Corrected: assign then check
-         IdentifierStr += static_cast<char>(LastChar);
-       }
+  Folding uses the same IEEE double arithmetic as the generated code, so without
+  fast-math every rewrite is exact. Operands are never dropped unless they are
+  literals, so calls and assignments always run. A rewrite that would hand an
+  array to a context expecting a number (xs*1 -> xs) is skipped, codegen reports it.
+  x*2 -> x+x style strength reduction is left out on purpose: InstCombine turns
+  x+x back into x*2.
+*/
+// * Whether an 'if' takes its then branch on condition C, like the generated code
+//   (fcmp one C, 0): NaN is false.
+static bool IsTrueCondition(double C) { return C == C && C != 0.0; }
 
-       if (IdentifierStr == "fn") {
-         return tok_def;
-       }
-       if (IdentifierStr == "incl") {
-         return tok_extern;
-       }
-       return tok_identifier;
-     }
+// * Evaluates A Op B like the generated code would, false for an unknown operator.
+static bool FoldBinaryOp(char Op, double A, double B, double &Result) {
+  switch (Op) {
+    case '+': Result = A + B; return true;
+    case '-': Result = A - B; return true;
+    case '*': Result = A * B; return true;
+    case '<': Result = !(A >= B) ? 1.0 : 0.0; return true; // unordered or less, as fcmp ult
+    case ':': Result = B; return true;
+    default: return false;
+  }
+}
 
-     if (isdigit(LastChar) || LastChar == '.') {
-       std::string NumStr;
-       do {
-         NumStr += static_cast<char>(LastChar);
-         LastChar = getchar();
-       } while (isdigit(LastChar) || LastChar == '.');
+class ASTSimplifier {
+private:
+  // [1st] New nodes (folded literals) go into the arena of the item being simplified.
+  // [2nd] Rewrites allowed for the current function, from --fast-math or 'fastmath'.
+  // [3rd] Names that may hold an array: array arguments and locals assigned an array.
 
-       NumVal = std::stod(NumStr);
-       return tok_number;
-     }
+  ASTArena &Arena; // [1st]
 
-     if (LastChar == '#') { // Comment until end of line
-       do {
-         LastChar = getchar();
-       } while (LastChar != EOF && LastChar != '\n' && LastChar != '\r');
+  bool NoSignedZeros = false, Reassoc = false; // [2nd]
 
-       if (LastChar != EOF) {
-         return gettok();
-       }
-     }
+  llvm::DenseSet<Symbol> ArrayNames; // [3rd]
 
-     if (LastChar == EOF) {
-       return tok_eof;
-     }
+public:
+  // * Counters over every body simplified so far.
+  struct Counters {
+    uint64_t NodesIn = 0;  // nodes visited
+    uint64_t Removed = 0;  // net nodes removed
+    uint64_t Folded = 0;   // operations on two literals evaluated
+    uint64_t Identities = 0;
+    uint64_t Reassociated = 0;
+  } Stats;
 
-     int ThisChar = LastChar;
-     LastChar = getchar();
-     return ThisChar;
-   }
-   const std::string& getIdentifierStr() const { return IdentifierStr; }
-   double getNumVal() const { return NumVal; }
-   // void setCurTok(int tok) { CurTok = tok; } // Not used in this version
-   int getCurTok() const { return CurTok; }
+  ASTSimplifier(ASTArena &Arena) : Arena(Arena) {}
+
+  // * Simplifies Body, a function body with prototype Proto.
+  ExprAST *run(ExprAST *Body, const PrototypeAST &Proto) {
+    llvm::FastMathFlags FMF = GlobalFMF;
+    if (Proto.hasAttr(FnAttr_FastMath)) {
+      FMF.setFast();
+    }
+    NoSignedZeros = FMF.noSignedZeros();
+    Reassoc = FMF.allowReassoc();
+    ArrayNames.clear();
+    for (unsigned i = 0; i < Proto.getArgs().size(); ++i) {
+      if (Proto.isArrayArg(i)) {
+        ArrayNames.insert(Proto.getArgs()[i]);
+      }
+    }
+    return visit(Body);
+  }
+
+  ExprAST *visit(ExprAST *E) {
+    ++Stats.NodesIn;
+    return E->simplify(*this);
+  }
+
+  llvm::ArrayRef<ExprAST *> copyArgs(llvm::ArrayRef<ExprAST *> Args) {
+    return Arena.copyArray(Args);
+  }
+
+  // * Conservative check that E evaluates to a number, not an array.
+  bool isNumber(ExprAST *E) const {
+    if (auto *V = dynamic_cast<VariableExprAST *>(E)) {
+      return !ArrayNames.count(V->getSymbol());
+    }
+    if (auto *B = dynamic_cast<BinaryExprAST *>(E)) {
+      return B->getOp() != ':';
+    }
+    if (auto *C = dynamic_cast<CallExprAST *>(E)) {
+      return C->getCallee() != Sym_array && C->getCallee() != Sym_map;
+    }
+    return dynamic_cast<NumberExprAST *>(E) || dynamic_cast<IndexExprAST *>(E);
+  }
+
+  void noteAssignment(Symbol Name, ExprAST *Value) {
+    if (!isNumber(Value)) {
+      ArrayNames.insert(Name);
+    }
+  }
+
+  // * Rewrites LHS Op RHS (operands already simplified), returns nullptr to keep the node.
+  ExprAST *simplifyBinary(char Op, ExprAST *LHS, ExprAST *RHS) {
+    auto *L = dynamic_cast<NumberExprAST *>(LHS);
+    auto *R = dynamic_cast<NumberExprAST *>(RHS);
+
+    if (Op == ':') { // a literal on the left has no effect
+      return L ? removed(2, RHS, Stats.Identities) : nullptr;
+    }
+    double V;
+    if (L && R && FoldBinaryOp(Op, L->getVal(), R->getVal(), V)) {
+      return folded(V);
+    }
+
+    // x op c with a literal c, constants on the left of + and * are moved right.
+    ExprAST *X = LHS;
+    NumberExprAST *C = R;
+    if (!C && L && (Op == '+' || Op == '*')) {
+      X = RHS;
+      C = L;
+    }
+    if (!C || !isNumber(X)) {
+      return nullptr;
+    }
+    double K = C->getVal();
+    if ((Op == '*' && K == 1.0) || (Op == '-' && K == 0.0 && !std::signbit(K)) ||
+        (Op == '+' && K == 0.0 && NoSignedZeros)) {
+      return removed(2, X, Stats.Identities);
+    }
+
+    // (y op c1) op c2 -> y op (c1 op c2) for + and *, reassociation only.
+    auto *Inner = dynamic_cast<BinaryExprAST *>(X);
+    if (Reassoc && (Op == '+' || Op == '*') && Inner && Inner->getOp() == Op) {
+      ExprAST *Y = nullptr;
+      NumberExprAST *C1 = nullptr;
+      Inner->getOperands(Y, C1);
+      if (C1) {
+        double K1 = Op == '+' ? C1->getVal() + K : C1->getVal() * K;
+        ++Stats.Reassociated;
+        Stats.Removed += 2;
+        return Arena.make<BinaryExprAST>(Op, Y, Arena.make<NumberExprAST>(K1));
+      }
+    }
+    return nullptr;
+  }
+
+  // * The if of a constant condition, replaced by the branch that is taken.
+  ExprAST *selectBranch(ExprAST *Taken) {
+    ++Stats.Folded;
+    Stats.Removed += 2; // the if and its condition, the dropped branch isn't counted
+    return visit(Taken);
+  }
+
+private:
+  ExprAST *folded(double V) {
+    ++Stats.Folded;
+    Stats.Removed += 2;
+    return Arena.make<NumberExprAST>(V);
+  }
+
+  ExprAST *removed(unsigned Nodes, ExprAST *Kept, uint64_t &Counter) {
+    ++Counter;
+    Stats.Removed += Nodes;
+    return Kept;
+  }
 };
 
-class parser {
- private:
-   lexer& m_lexer;
+ExprAST *BinaryExprAST::simplify(ASTSimplifier &S) {
+  LHS = S.visit(LHS);
+  RHS = S.visit(RHS);
+  if (ExprAST *E = S.simplifyBinary(Op, LHS, RHS)) {
+    return E;
+  }
+  return this;
+}
 
- public:
-   std::map<char, int> BinopPrecedence;
-   parser(lexer& lexer_instance) : m_lexer(lexer_instance) {
-     BinopPrecedence['<'] = 10;
-     BinopPrecedence['+'] = 20;
-     BinopPrecedence['-'] = 20; // Same precedence as +
-     BinopPrecedence['*'] = 40; // Higher precedence
-   }
+// * Splits 'y op c' / 'c op y' into the non-literal operand and the literal, if any.
+void BinaryExprAST::getOperands(ExprAST *&Y, NumberExprAST *&C) const {
+  if ((C = dynamic_cast<NumberExprAST *>(RHS))) {
+    Y = LHS;
+  } else if ((C = dynamic_cast<NumberExprAST *>(LHS))) {
+    Y = RHS;
+  }
+}
 
-   
-   int getTokPrecedence() {
-     if (!isascii(m_lexer.getCurTok())) {
-       return -1;
-     }
+ExprAST *CallExprAST::simplify(ASTSimplifier &S) {
+  llvm::SmallVector<ExprAST *, 8> NewArgs;
+  bool Changed = false;
+  for (ExprAST *Arg : Args) {
+    NewArgs.push_back(S.visit(Arg));
+    Changed |= NewArgs.back() != Arg;
+  }
+  if (Changed) {
+    Args = S.copyArgs(NewArgs);
+  }
+  return this;
+}
 
-     // Make sure it's a declared binop.
-     int TokPrec = BinopPrecedence[static_cast<char>(m_lexer.getCurTok())];
-     if (TokPrec <= 0) return -1;
-     return TokPrec;
-   }
-   
-   int getNextToken() {
-     return m_lexer.CurTok = m_lexer.gettok();
-   }
+ExprAST *IndexExprAST::simplify(ASTSimplifier &S) {
+  Index = S.visit(Index);
+  return this;
+}
 
-   template <typename T>
-   static std::unique_ptr<T> LogError(const char *str)
-   {
-     llvm::errs() << "Error: " << str << '\n';
-     return nullptr;
-   }
+ExprAST *AssignExprAST::simplify(ASTSimplifier &S) {
+  Expr = S.visit(Expr);
+  if (Index) {
+    Index = S.visit(Index);
+  } else {
+    S.noteAssignment(VarName, Expr);
+  }
+  return this;
+}
 
-   std::unique_ptr<ExprAST> ParsePrimary() {
-    switch(m_lexer.getCurTok()) {
-      default:
-        return LogError<ExprAST>("Unknown token when expecting an expression");
-      case tok_identifier: {
-        auto LHS = ParseIdentifierExpr();
-        if (m_lexer.getCurTok() == '=') {
-          return ParseAssignmentExpr(std::move(LHS), *this);
+ExprAST *IfExprAST::simplify(ASTSimplifier &S) {
+  Cond = S.visit(Cond);
+  if (auto *C = dynamic_cast<NumberExprAST *>(Cond)) { // only one branch can ever run
+    return S.selectBranch(IsTrueCondition(C->getVal()) ? Then : Else);
+  }
+  Then = S.visit(Then);
+  Else = S.visit(Else);
+  return this;
+}
+
+ExprAST *ForExprAST::simplify(ASTSimplifier &S) {
+  Start = S.visit(Start);
+  End = S.visit(End);
+  if (Step) {
+    Step = S.visit(Step);
+  }
+  Body = S.visit(Body);
+  return this;
+}
+
+void FunctionAST::simplify(ASTSimplifier &S) { Body = S.run(Body, *Proto); }
+// END AST SIMPLIFIER
+
+// BEGIN CONSTANT EVALUATION
+/*
+  A top-level expression made only of literals, operators and calls to known pure
+  functions has no effects and needs nothing from the JIT, so the drivers evaluate
+  it right here instead of building, linking and calling an __anon_expr function.
+  Pure functions still have to be declared with 'incl' as usual, and a 'fn' of the
+  same name in the current module takes precedence over the host function.
+*/
+struct PureFunction {
+  const char *Name;
+  unsigned NumArgs;
+  double (*Fn1)(double);
+  double (*Fn2)(double, double);
+};
+
+extern "C" double randd(double x);
+
+static const PureFunction *lookupPureFunction(llvm::StringRef Name) {
+  static const PureFunction Table[] = {
+      {"randd", 1, &randd, nullptr},
+      {"sqrt", 1, [](double x) { return std::sqrt(x); }, nullptr},
+      {"sin", 1, [](double x) { return std::sin(x); }, nullptr},
+      {"cos", 1, [](double x) { return std::cos(x); }, nullptr},
+      {"tan", 1, [](double x) { return std::tan(x); }, nullptr},
+      {"atan", 1, [](double x) { return std::atan(x); }, nullptr},
+      {"exp", 1, [](double x) { return std::exp(x); }, nullptr},
+      {"log", 1, [](double x) { return std::log(x); }, nullptr},
+      {"fabs", 1, [](double x) { return std::fabs(x); }, nullptr},
+      {"floor", 1, [](double x) { return std::floor(x); }, nullptr},
+      {"ceil", 1, [](double x) { return std::ceil(x); }, nullptr},
+      {"pow", 2, nullptr, [](double x, double y) { return std::pow(x, y); }},
+      {"atan2", 2, nullptr, [](double x, double y) { return std::atan2(x, y); }},
+      {"fmod", 2, nullptr, [](double x, double y) { return std::fmod(x, y); }},
+  };
+  for (const PureFunction &F : Table) {
+    if (Name == F.Name) {
+      return &F;
+    }
+  }
+  return nullptr;
+}
+
+// * Returns the value of E if it is pure and closed, false if it needs codegen.
+static bool EvaluateConstant(ExprAST *E, double &Result) {
+  if (auto *N = dynamic_cast<NumberExprAST *>(E)) {
+    Result = N->getVal();
+    return true;
+  }
+  if (auto *B = dynamic_cast<BinaryExprAST *>(E)) {
+    double L, R;
+    return EvaluateConstant(B->getLHS(), L) && EvaluateConstant(B->getRHS(), R) &&
+           FoldBinaryOp(B->getOp(), L, R, Result);
+  }
+  if (auto *I = dynamic_cast<IfExprAST *>(E)) {
+    double C;
+    return EvaluateConstant(I->getCond(), C) &&
+           EvaluateConstant(IsTrueCondition(C) ? I->getThen() : I->getElse(), Result);
+  }
+  auto *C = dynamic_cast<CallExprAST *>(E);
+  if (!C) {
+    return false;
+  }
+  const PrototypeAST *Proto = FunctionProtos.lookup(C->getCallee()).get();
+  if (!Proto || Proto->getArgs().size() != C->getArgs().size()) {
+    return false;
+  }
+  const PureFunction *F = lookupPureFunction(C->getCalleeName());
+  if (!F || C->getArgs().size() != F->NumArgs) {
+    return false;
+  }
+  llvm::Function *Defined = TheModule->getFunction(C->getCalleeName());
+  if (Defined && !Defined->isDeclaration()) {
+    return false;
+  }
+
+  double Args[2];
+  for (unsigned i = 0; i < F->NumArgs; ++i) {
+    if (Proto->isArrayArg(i) || !EvaluateConstant(C->getArgs()[i], Args[i])) {
+      return false;
+    }
+  }
+  Result = F->NumArgs == 1 ? F->Fn1(Args[0]) : F->Fn2(Args[0], Args[1]);
+  return true;
+}
+// END CONSTANT EVALUATION
+
+// * LLVM ERROR HANDLING
+llvm::Value *LogErrorV(const char *Str) {
+ errorStream() << "LLVM Error: " << Str << '\n';
+ return nullptr;
+}
+// * END LLVM ERROR HANDLING
+
+// ---------------------------------BEGIN CODEGEN IMPLEMENTATIONS--------------------------------
+// * Every local (arguments, assigned names, loop variables) lives in a stack slot
+//   created in the function's entry block, so mem2reg / SROA can promote all of them
+//   back to registers whatever control flow sits between their loads and stores.
+static llvm::AllocaInst *CreateEntryBlockAlloca(llvm::Function *TheFunction, llvm::StringRef VarName,
+                                                llvm::Type *Ty = nullptr) {
+ llvm::IRBuilder<> TmpB(&TheFunction->getEntryBlock(), TheFunction->getEntryBlock().begin());
+ return TmpB.CreateAlloca(Ty ? Ty : llvm::Type::getDoubleTy(*TheContext), nullptr, VarName);
+}
+
+// * Looks a function up in the current module, or declares it from FunctionProtos
+//   or, if it was defined in a module that is already in the JIT, DefinedProtos.
+static llvm::Function *getFunction(Symbol Name) {
+ if (llvm::Function *F = TheModule->getFunction(Symbols.getName(Name))) {
+   return F;
+ }
+ if (const auto &Proto = FunctionProtos.lookup(Name)) {
+   return Proto->codegen();
+ }
+ if (const auto &Proto = DefinedProtos.lookup(Name)) {
+   return Proto->codegen();
+ }
+ return nullptr;
+}
+
+// BEGIN VECTOR VARIANTS
+/*
+  SIMD versions of user functions. A function whose optimized body is loop-free
+  arithmetic (FP operations, compares, selects, ifs, math functions like sqrt and
+  calls to functions that have variants themselves) is pure; it is marked readnone
+  and cloned lane-wise into
+
+    <W x double> f.vW(<W x double>, ...)     for every W in VectorVariantWidths
+
+  Branches are if-converted: the variant computes every block, each under the mask
+  of lanes that reach it, and phis become selects on the masks of their edges.
+
+  Calls to f carry the vector-function-abi-variant attribute naming the variants
+  (LLVM's internal VFABI ISA, '_ZGV_LLVM_N4vv_f(f.v4)'), so the loop vectorizer can
+  widen a loop that calls f to calls of f.vW when f isn't inlined, e.g. because it
+  was defined in an earlier module or is too big.
+*/
+static const unsigned VectorVariantWidths[] = {4, 8};
+
+static std::string getVectorVariantName(llvm::StringRef Scalar, unsigned W) {
+  return (Scalar + ".v" + llvm::Twine(W)).str();
+}
+
+// * Declares F's variant of width W in the current module, or finds it.
+static llvm::Function *getVectorVariant(llvm::Function *F, unsigned W) {
+  std::string Name = getVectorVariantName(F->getName(), W);
+  if (llvm::Function *V = TheModule->getFunction(Name)) {
+    return V;
+  }
+  llvm::Type *VecTy = llvm::FixedVectorType::get(llvm::Type::getDoubleTy(*TheContext), W);
+  std::vector<llvm::Type *> Params(F->arg_size(), VecTy);
+  llvm::Function *V = llvm::Function::Create(llvm::FunctionType::get(VecTy, Params, false),
+                                             llvm::Function::ExternalLinkage, Name, TheModule.get());
+  V->setDoesNotAccessMemory();
+  return V;
+}
+
+// * Calls a user function, telling the vectorizer about its variants if it has any.
+static llvm::CallInst *CreateUserCall(llvm::Function *F, llvm::ArrayRef<llvm::Value *> Args,
+                                      const llvm::Twine &Name) {
+  llvm::CallInst *CI = Builder->CreateCall(F, Args, Name);
+  llvm::SmallVector<std::string, 8> Mappings;
+  for (unsigned W : VectorVariantWidths) {
+    llvm::Function *V = TheModule->getFunction(getVectorVariantName(F->getName(), W));
+    if (!V) {
+      continue;
+    }
+    if (V->isDeclaration()) {
+      llvm::appendToCompilerUsed(*TheModule, {V}); // keep it until the vectorizer ran
+    }
+    Mappings.push_back(("_ZGV_LLVM_N" + llvm::Twine(W) + std::string(F->arg_size(), 'v') + "_" +
+                        F->getName() + "(" + V->getName() + ")").str());
+  }
+  if (!Mappings.empty()) {
+    llvm::VFABI::setVectorVariantNames(CI, Mappings);
+  }
+  return CI;
+}
+
+// * The intrinsic a call to Callee can be widened to: its own ID, or the intrinsic
+//   of an 'incl' math function declared with the intrinsic's number of arguments.
+static llvm::Intrinsic::ID getWidenableIntrinsic(const llvm::Function *Callee) {
+  if (llvm::Intrinsic::ID ID = Callee->getIntrinsicID()) {
+    return llvm::isTriviallyVectorizable(ID) ? ID : llvm::Intrinsic::not_intrinsic;
+  }
+  if (!Callee->isDeclaration()) {
+    return llvm::Intrinsic::not_intrinsic;
+  }
+  auto Math = llvm::StringSwitch<std::pair<llvm::Intrinsic::ID, unsigned>>(Callee->getName())
+                  .Case("sqrt", {llvm::Intrinsic::sqrt, 1})
+                  .Case("sin", {llvm::Intrinsic::sin, 1})
+                  .Case("cos", {llvm::Intrinsic::cos, 1})
+                  .Case("exp", {llvm::Intrinsic::exp, 1})
+                  .Case("log", {llvm::Intrinsic::log, 1})
+                  .Case("fabs", {llvm::Intrinsic::fabs, 1})
+                  .Case("floor", {llvm::Intrinsic::floor, 1})
+                  .Case("ceil", {llvm::Intrinsic::ceil, 1})
+                  .Case("pow", {llvm::Intrinsic::pow, 2})
+                  .Default({llvm::Intrinsic::not_intrinsic, 0});
+  return Callee->arg_size() == Math.second ? Math.first : llvm::Intrinsic::not_intrinsic;
+}
+
+// * Whether I can be widened lane by lane: arithmetic on numbers and booleans, a
+//   branch, or a call that has a vector form of every width.
+static bool isWidenable(const llvm::Instruction &I) {
+  if (llvm::isa<llvm::BranchInst>(I)) {
+    return true;
+  }
+  for (const llvm::Value *Op : I.operands()) {
+    if (!Op->getType()->isDoubleTy() && !Op->getType()->isIntegerTy() && !llvm::isa<llvm::Function>(Op)) {
+      return false;
+    }
+  }
+  if (llvm::isa<llvm::ReturnInst>(I)) {
+    return true;
+  }
+  if (!I.getType()->isDoubleTy() && !I.getType()->isIntegerTy()) {
+    return false;
+  }
+  if (llvm::isa<llvm::BinaryOperator>(I) || llvm::isa<llvm::UnaryOperator>(I) ||
+      llvm::isa<llvm::CmpInst>(I) || llvm::isa<llvm::SelectInst>(I) || llvm::isa<llvm::CastInst>(I) ||
+      llvm::isa<llvm::PHINode>(I)) {
+    return true;
+  }
+  const auto *CI = llvm::dyn_cast<llvm::CallInst>(&I);
+  const llvm::Function *Callee = CI ? CI->getCalledFunction() : nullptr;
+  if (!Callee || !I.getType()->isDoubleTy()) {
+    return false;
+  }
+  if (llvm::all_of(VectorVariantWidths, [&](unsigned W) {
+        return TheModule->getFunction(getVectorVariantName(Callee->getName(), W)) != nullptr;
+      })) {
+    return true;
+  }
+  return getWidenableIntrinsic(Callee) &&
+         llvm::all_of(CI->args(), [](const llvm::Use &A) { return A->getType()->isDoubleTy(); });
+}
+
+// * Fills in F's variant of width W, F being widenable and Blocks its blocks in
+//   reverse post order. Returns false if the variant came out invalid.
+static bool EmitVectorVariant(llvm::Function *F, unsigned W,
+                              llvm::ArrayRef<llvm::BasicBlock *> Blocks) {
+  llvm::Function *V = getVectorVariant(F, W);
+  llvm::IRBuilderBase::InsertPointGuard Guard(*Builder);
+  Builder->SetInsertPoint(llvm::BasicBlock::Create(*TheContext, "entry", V));
+
+  llvm::ElementCount EC = llvm::ElementCount::getFixed(W);
+  llvm::DenseMap<const llvm::Value *, llvm::Value *> Lanes;
+  for (unsigned i = 0; i < F->arg_size(); ++i) {
+    V->getArg(i)->setName(F->getArg(i)->getName());
+    Lanes[F->getArg(i)] = V->getArg(i);
+  }
+  auto Widen = [&](llvm::Value *X) -> llvm::Value * {
+    if (auto *C = llvm::dyn_cast<llvm::Constant>(X)) {
+      return llvm::ConstantVector::getSplat(EC, C);
+    }
+    return Lanes.lookup(X);
+  };
+
+  // Masks of the lanes that reach a block or take an edge; null is all lanes.
+  llvm::DenseMap<const llvm::BasicBlock *, llvm::Value *> BlockMasks;
+  llvm::DenseMap<std::pair<const llvm::BasicBlock *, const llvm::BasicBlock *>, llvm::Value *> EdgeMasks;
+  auto And = [&](llvm::Value *A, llvm::Value *B) { return A && B ? Builder->CreateAnd(A, B) : A ? A : B; };
+  auto AddEdge = [&](const llvm::BasicBlock *From, const llvm::BasicBlock *To, llvm::Value *Mask) {
+    EdgeMasks[{From, To}] = Mask;
+    auto Reached = BlockMasks.try_emplace(To, Mask);
+    if (!Reached.second) {
+      llvm::Value *&M = Reached.first->second;
+      M = M && Mask ? Builder->CreateOr(M, Mask) : nullptr;
+    }
+  };
+
+  for (llvm::BasicBlock *BB : Blocks) {
+    llvm::Value *Mask = BlockMasks.lookup(BB);
+    for (llvm::Instruction &I : *BB) {
+      llvm::Value *R;
+      if (auto *B = llvm::dyn_cast<llvm::BinaryOperator>(&I)) {
+        R = Builder->CreateBinOp(B->getOpcode(), Widen(B->getOperand(0)), Widen(B->getOperand(1)));
+      } else if (auto *U = llvm::dyn_cast<llvm::UnaryOperator>(&I)) {
+        R = Builder->CreateUnOp(U->getOpcode(), Widen(U->getOperand(0)));
+      } else if (auto *C = llvm::dyn_cast<llvm::CmpInst>(&I)) {
+        R = Builder->CreateCmp(C->getPredicate(), Widen(C->getOperand(0)), Widen(C->getOperand(1)));
+      } else if (auto *S = llvm::dyn_cast<llvm::SelectInst>(&I)) {
+        R = Builder->CreateSelect(Widen(S->getCondition()), Widen(S->getTrueValue()),
+                                  Widen(S->getFalseValue()));
+      } else if (auto *C = llvm::dyn_cast<llvm::CastInst>(&I)) {
+        R = Builder->CreateCast(C->getOpcode(), Widen(C->getOperand(0)),
+                                llvm::VectorType::get(C->getType(), EC));
+      } else if (auto *P = llvm::dyn_cast<llvm::PHINode>(&I)) {
+        // Each lane in BB came along exactly one incoming edge.
+        R = Widen(P->getIncomingValue(0));
+        for (unsigned i = 1; i < P->getNumIncomingValues(); ++i) {
+          llvm::Value *EdgeMask = EdgeMasks.lookup({P->getIncomingBlock(i), BB});
+          llvm::Value *X = Widen(P->getIncomingValue(i));
+          R = EdgeMask ? Builder->CreateSelect(EdgeMask, X, R) : X;
         }
-        return LHS;
+      } else if (auto *C = llvm::dyn_cast<llvm::CallInst>(&I)) {
+        std::vector<llvm::Value *> Args;
+        for (llvm::Value *A : C->args()) {
+          Args.push_back(Widen(A));
+        }
+        llvm::Function *Callee = C->getCalledFunction();
+        if (TheModule->getFunction(getVectorVariantName(Callee->getName(), W))) {
+          R = Builder->CreateCall(getVectorVariant(Callee, W), Args);
+        } else {
+          R = Builder->CreateIntrinsic(getWidenableIntrinsic(Callee), {Args[0]->getType()}, Args);
+        }
+      } else if (auto *Br = llvm::dyn_cast<llvm::BranchInst>(&I)) {
+        if (Br->isUnconditional() || Br->getSuccessor(0) == Br->getSuccessor(1)) {
+          AddEdge(BB, Br->getSuccessor(0), Mask);
+        } else {
+          llvm::Value *Cond = Widen(Br->getCondition());
+          AddEdge(BB, Br->getSuccessor(0), And(Mask, Cond));
+          AddEdge(BB, Br->getSuccessor(1), And(Mask, Builder->CreateNot(Cond)));
+        }
+        continue;
+      } else {
+        Builder->CreateRet(Widen(llvm::cast<llvm::ReturnInst>(I).getReturnValue()));
+        continue;
       }
-      case tok_number:
-        return ParseNumberExpr();
-      case '(':
-        return ParseParenExpr();
+      if (auto *RI = llvm::dyn_cast<llvm::Instruction>(R)) {
+        RI->copyIRFlags(&I); // fast-math flags, nsw, ...
+      }
+      Lanes[&I] = R;
     }
   }
+  return !llvm::verifyFunction(*V, &errorStream());
+}
 
-   std::unique_ptr<ExprAST> ParseExpression() {
-     auto LHS = ParsePrimary();
-     if (!LHS) {
-       return nullptr;
-     }
+// * Emits F's variants if its body is loop-free arithmetic with a single return.
+//   Only worth it when the loop vectorizer runs.
+static bool EmitVectorVariants(llvm::Function *F) {
+  if (OptLevel < 2 || F->arg_size() == 0 ||
+      !llvm::all_of(F->args(), [](const llvm::Argument &A) { return A.getType()->isDoubleTy(); })) {
+    return false;
+  }
+  llvm::ReversePostOrderTraversal<llvm::Function *> RPOT(F);
+  std::vector<llvm::BasicBlock *> Blocks(RPOT.begin(), RPOT.end());
+  if (Blocks.size() != F->size()) {
+    return false; // unreachable blocks
+  }
+  llvm::DenseSet<const llvm::BasicBlock *> Seen;
+  unsigned Returns = 0;
+  for (llvm::BasicBlock *BB : Blocks) {
+    Seen.insert(BB);
+    for (const llvm::BasicBlock *Succ : llvm::successors(BB)) {
+      if (Seen.count(Succ)) {
+        return false; // a loop
+      }
+    }
+    Returns += llvm::isa<llvm::ReturnInst>(BB->getTerminator());
+    if (!llvm::all_of(*BB, isWidenable)) {
+      return false;
+    }
+  }
+  if (Returns != 1) {
+    return false;
+  }
+  F->setDoesNotAccessMemory();
+  for (unsigned W : VectorVariantWidths) {
+    if (!EmitVectorVariant(F, W, Blocks)) {
+      for (unsigned Emitted : VectorVariantWidths) {
+        if (llvm::Function *V = TheModule->getFunction(getVectorVariantName(F->getName(), Emitted))) {
+          V->eraseFromParent();
+        }
+      }
+      return false;
+    }
+  }
+  return true;
+}
+// END VECTOR VARIANTS
+
+/*
+  Emits the canonical loop used for every loop in the language:
+
+    guard:      tripcount > 0 --> loop.ph or loop.end
+    loop.ph:    preheader --> loop
+    loop:       k = phi i64 [0, loop.ph], [k.next, loop.latch]
+                Body(k)
+    loop.latch: k.next = k + 1, k.next < tripcount --> loop or loop.exit
+    loop.exit:  --> loop.end
+
+  The i64 k is the only induction variable, so the trip count is computable and
+  the vectorizer can widen the loop. Leaves the builder at the start of loop.end.
+*/
+static bool EmitCountedLoop(llvm::Value *TripCount,
+                            llvm::function_ref<bool(llvm::Value *K)> Body) {
+ llvm::Type *I64 = llvm::Type::getInt64Ty(*TheContext);
+ llvm::Function *TheFunction = Builder->GetInsertBlock()->getParent();
+ llvm::BasicBlock *PreheaderBB = llvm::BasicBlock::Create(*TheContext, "loop.ph", TheFunction);
+ llvm::BasicBlock *LoopBB = llvm::BasicBlock::Create(*TheContext, "loop", TheFunction);
+ llvm::BasicBlock *LatchBB = llvm::BasicBlock::Create(*TheContext, "loop.latch");
+ llvm::BasicBlock *ExitBB = llvm::BasicBlock::Create(*TheContext, "loop.exit");
+ llvm::BasicBlock *EndBB = llvm::BasicBlock::Create(*TheContext, "loop.end");
+
+ llvm::Value *HasTrips = Builder->CreateICmpSGT(TripCount, llvm::ConstantInt::get(I64, 0), "hastrips");
+ Builder->CreateCondBr(HasTrips, PreheaderBB, EndBB);
+ Builder->SetInsertPoint(PreheaderBB);
+ Builder->CreateBr(LoopBB);
+
+ Builder->SetInsertPoint(LoopBB);
+ llvm::PHINode *K = Builder->CreatePHI(I64, 2, "k");
+ K->addIncoming(llvm::ConstantInt::get(I64, 0), PreheaderBB);
+
+ if (!Body(K)) {
+   return false;
+ }
+
+ TheFunction->getBasicBlockList().push_back(LatchBB);
+ Builder->CreateBr(LatchBB);
+ Builder->SetInsertPoint(LatchBB);
+ llvm::Value *KNext = Builder->CreateAdd(K, llvm::ConstantInt::get(I64, 1), "k.next",
+                                         /*HasNUW=*/true, /*HasNSW=*/true);
+ K->addIncoming(KNext, LatchBB);
+ Builder->CreateCondBr(Builder->CreateICmpSLT(KNext, TripCount, "loopcond"), LoopBB, ExitBB);
+
+ TheFunction->getBasicBlockList().push_back(ExitBB);
+ Builder->SetInsertPoint(ExitBB);
+ Builder->CreateBr(EndBB);
+
+ TheFunction->getBasicBlockList().push_back(EndBB);
+ Builder->SetInsertPoint(EndBB);
+ return true;
+}
+
+// BEGIN ARRAY SUPPORT
+/*
+  An array value is the first-class struct { double *data, i64 len }. It is passed
+  by value, which matches the C ABI of
+
+    struct bl_array { double *data; int64_t len; };
+
+  so the host can hand its own buffers to a compiled 'fn f(xs[])'. Arrays created
+  by a script (array(n), map) come from the runtime's array stack and are released
+  when the function that created them returns; since functions only return numbers,
+  no array can outlive that.
+*/
+static llvm::StructType *getArrayTy() {
+ return llvm::StructType::get(*TheContext, {llvm::Type::getDoublePtrTy(*TheContext),
+                                            llvm::Type::getInt64Ty(*TheContext)});
+}
+
+static bool isArray(llvm::Value *V) { return V->getType() == getArrayTy(); }
+
+// * Declares one of the runtime functions defined in the host (see main()).
+static llvm::FunctionCallee getRuntimeFunction(llvm::StringRef Name) {
+ llvm::Type *I64 = llvm::Type::getInt64Ty(*TheContext);
+ llvm::Type *Void = llvm::Type::getVoidTy(*TheContext);
+ if (Name == "bl_array_alloc") {
+   llvm::Function *F = llvm::cast<llvm::Function>(TheModule->getOrInsertFunction(
+       Name, llvm::Type::getDoublePtrTy(*TheContext), I64).getCallee());
+   F->setReturnDoesNotAlias();
+   F->setDoesNotThrow();
+   return F;
+ }
+ if (Name == "bl_array_mark") {
+   return TheModule->getOrInsertFunction(Name, I64);
+ }
+ if (Name == "bl_pfor") {
+   llvm::Type *DoubleTy = llvm::Type::getDoubleTy(*TheContext);
+   llvm::Type *ChunkFnTy = llvm::FunctionType::get(DoubleTy, {DoubleTy, DoubleTy}, false);
+   return TheModule->getOrInsertFunction(Name, DoubleTy, DoubleTy, DoubleTy, DoubleTy,
+                                         ChunkFnTy->getPointerTo());
+ }
+ if (Name == "bl_memo_lookup") {
+   llvm::Type *I8Ptr = llvm::Type::getInt8PtrTy(*TheContext);
+   llvm::Type *DoublePtr = llvm::Type::getDoublePtrTy(*TheContext);
+   return TheModule->getOrInsertFunction(Name, llvm::Type::getInt32Ty(*TheContext),
+                                         I8Ptr->getPointerTo(), I8Ptr, I64, DoublePtr, DoublePtr);
+ }
+ if (Name == "bl_memo_store") {
+   llvm::Type *I8Ptr = llvm::Type::getInt8PtrTy(*TheContext);
+   return TheModule->getOrInsertFunction(Name, Void, I8Ptr->getPointerTo(),
+                                         llvm::Type::getDoublePtrTy(*TheContext),
+                                         llvm::Type::getDoubleTy(*TheContext));
+ }
+ return TheModule->getOrInsertFunction(Name, Void, I64); // bl_array_release
+}
+
+// * Allocates a zeroed array of Len (i64) elements.
+static llvm::Value *CreateArray(llvm::Value *Len) {
+ llvm::Value *Data = Builder->CreateCall(getRuntimeFunction("bl_array_alloc"), {Len}, "data");
+ llvm::Value *Arr = llvm::UndefValue::get(getArrayTy());
+ Arr = Builder->CreateInsertValue(Arr, Data, 0);
+ return Builder->CreateInsertValue(Arr, Len, 1, "array");
+}
+
+static llvm::Value *getElementPtr(llvm::Value *Arr, llvm::Value *K) {
+ llvm::Value *Data = Builder->CreateExtractValue(Arr, 0, "data");
+ return Builder->CreateInBoundsGEP(llvm::Type::getDoubleTy(*TheContext), Data, K, "elt");
+}
+
+static llvm::Value *LoadElement(llvm::Value *Arr, llvm::Value *K) {
+ return Builder->CreateLoad(llvm::Type::getDoubleTy(*TheContext), getElementPtr(Arr, K), "x");
+}
+
+// * Converts a number to an element index / count.
+static llvm::Value *ToIndex(llvm::Value *V) {
+ return Builder->CreateFPToSI(V, llvm::Type::getInt64Ty(*TheContext), "idx");
+}
+
+static bool isArrayBuiltin(Symbol Name) { return Name >= Sym_array && Name <= Sym_sum; }
+
+/*
+  array(n)            new array of n zeros
+  len(xs)             number of elements
+  map(xs, f)          new array of f(x) for every x in xs
+  reduce(xs, f, init) f(...f(f(init, x0), x1)..., xn)
+  dot(xs, ys)         sum of xs[k] * ys[k] over the shorter of the two
+  sum(xs)             sum of all elements
+
+  Each one is a counted loop over plain loads/stores (see EmitCountedLoop). Once f
+  is inlined, and with fast-math for the reductions, the loop vectorizer widens them.
+*/
+static llvm::Value *EmitArrayBuiltin(Symbol Name, llvm::ArrayRef<ExprAST *> Args) {
+ static const unsigned Arity[] = {1, 1, 2, 3, 2, 1}; // array, len, map, reduce, dot, sum
+ if (Args.size() != Arity[Name - Sym_array]) {
+   return LogErrorV("Incorrect # args passed");
+ }
+
+ llvm::Type *DoubleTy = llvm::Type::getDoubleTy(*TheContext);
+ llvm::Type *I64 = llvm::Type::getInt64Ty(*TheContext);
+ llvm::Function *TheFunction = Builder->GetInsertBlock()->getParent();
+
+ if (Name == Sym_array) {
+   llvm::Value *N = Args[0]->codegen();
+   if (!N) return nullptr;
+   if (isArray(N)) return LogErrorV("array() expects a number of elements");
+   N = ToIndex(N);
+   N = Builder->CreateSelect(Builder->CreateICmpSGT(N, llvm::ConstantInt::get(I64, 0)),
+                             N, llvm::ConstantInt::get(I64, 0), "len");
+   return CreateArray(N);
+ }
+
+ llvm::Value *Xs = Args[0]->codegen();
+ if (!Xs) return nullptr;
+ if (!isArray(Xs)) return LogErrorV("expected an array as first argument");
+ llvm::Value *Len = Builder->CreateExtractValue(Xs, 1, "len");
+
+ if (Name == Sym_len) {
+   return Builder->CreateSIToFP(Len, DoubleTy, "lentmp");
+ }
+
+ // map / reduce take the name of a function as second argument.
+ llvm::Function *F = nullptr;
+ if (Name == Sym_map || Name == Sym_reduce) {
+   auto *FnRef = dynamic_cast<VariableExprAST *>(Args[1]);
+   F = FnRef ? getFunction(FnRef->getSymbol()) : nullptr;
+   if (!F) return LogErrorV("expected a function name as second argument");
+   if (F->arg_size() != (Name == Sym_map ? 1u : 2u)) return LogErrorV("Incorrect # args of mapped function");
+   if (!F->getReturnType()->isDoubleTy() ||
+       !llvm::all_of(F->args(), [](const llvm::Argument &A) { return A.getType()->isDoubleTy(); })) {
+     return LogErrorV("mapped function must take and return numbers");
+   }
+ }
+
+ if (Name == Sym_map) {
+   llvm::Value *Ys = CreateArray(Len);
+   bool OK = EmitCountedLoop(Len, [&](llvm::Value *K) {
+     llvm::Value *Y = CreateUserCall(F, {LoadElement(Xs, K)}, "y");
+     Builder->CreateStore(Y, getElementPtr(Ys, K));
+     return true;
+   });
+   return OK ? Ys : nullptr;
+ }
+
+ // The rest are reductions over an accumulator slot.
+ llvm::Value *Init = llvm::ConstantFP::get(DoubleTy, 0.0);
+ llvm::Value *Ys = nullptr;
+ if (Name == Sym_reduce) {
+   Init = Args[2]->codegen();
+   if (!Init) return nullptr;
+   if (isArray(Init)) return LogErrorV("reduce() expects a number as initial value");
+ } else if (Name == Sym_dot) {
+   Ys = Args[1]->codegen();
+   if (!Ys) return nullptr;
+   if (!isArray(Ys)) return LogErrorV("dot() expects two arrays");
+   llvm::Value *YLen = Builder->CreateExtractValue(Ys, 1, "len");
+   Len = Builder->CreateSelect(Builder->CreateICmpSLT(Len, YLen), Len, YLen, "len");
+ }
+
+ llvm::AllocaInst *Acc = CreateEntryBlockAlloca(TheFunction, "acc");
+ Builder->CreateStore(Init, Acc);
+ bool OK = EmitCountedLoop(Len, [&](llvm::Value *K) {
+   llvm::Value *A = Builder->CreateLoad(DoubleTy, Acc, "acc");
+   llvm::Value *X = LoadElement(Xs, K);
+   if (Name == Sym_reduce) {
+     A = CreateUserCall(F, {A, X}, "acc");
+   } else if (Name == Sym_dot) {
+     A = Builder->CreateFAdd(A, Builder->CreateFMul(X, LoadElement(Ys, K), "multmp"), "acc");
+   } else {
+     A = Builder->CreateFAdd(A, X, "acc");
+   }
+   Builder->CreateStore(A, Acc);
+   return true;
+ });
+ if (!OK) return nullptr;
+ return Builder->CreateLoad(DoubleTy, Acc, Symbols.getName(Name));
+}
+// END ARRAY SUPPORT
+
+// BEGIN PARALLEL FOR
+/*
+  pfor(lo, hi, f)          sum of f(i) for i = lo, lo + 1, ... below hi
+  pfor(lo, hi, f, grain)   same, with grain iterations per chunk
+
+  Iterations run on the runtime's work-stealing pool (bl_pfor). The pool never
+  calls f per element: it calls a chunk function __pfor.<f>(a, b), generated here,
+  which loops over [a, b) with f inlinable into the loop body. Partial sums are
+  added in chunk order, so the result doesn't depend on scheduling.
+*/
+static llvm::Function *getPforChunkFunction(llvm::Function *F) {
+ std::string Name = ("__pfor." + F->getName()).str();
+ if (llvm::Function *W = TheModule->getFunction(Name)) {
+   return W;
+ }
+
+ llvm::Type *DoubleTy = llvm::Type::getDoubleTy(*TheContext);
+ llvm::Function *W = llvm::Function::Create(
+     llvm::FunctionType::get(DoubleTy, {DoubleTy, DoubleTy}, false),
+     llvm::Function::InternalLinkage, Name, TheModule.get());
+ llvm::IRBuilderBase::InsertPointGuard Guard(*Builder);
+ Builder->SetInsertPoint(llvm::BasicBlock::Create(*TheContext, "entry", W));
+
+ llvm::Value *Lo = W->getArg(0), *Hi = W->getArg(1);
+ llvm::Value *Span = Builder->CreateUnaryIntrinsic(llvm::Intrinsic::ceil,
+                                                   Builder->CreateFSub(Hi, Lo, "span"));
+ llvm::Value *TripCount = ToIndex(Span);
+
+ llvm::AllocaInst *Acc = CreateEntryBlockAlloca(W, "acc");
+ Builder->CreateStore(llvm::ConstantFP::get(DoubleTy, 0.0), Acc);
+ EmitCountedLoop(TripCount, [&](llvm::Value *K) {
+   llvm::Value *I = Builder->CreateFAdd(Lo, Builder->CreateSIToFP(K, DoubleTy), "i");
+   llvm::Value *A = Builder->CreateLoad(DoubleTy, Acc, "acc");
+   Builder->CreateStore(Builder->CreateFAdd(A, CreateUserCall(F, {I}, "y"), "acc"), Acc);
+   return true;
+ });
+ Builder->CreateRet(Builder->CreateLoad(DoubleTy, Acc, "acc"));
+
+ llvm::verifyFunction(*W);
+ if (TheFPM) {
+   PhaseTimer T(CompileStats::Optimize);
+   TheFPM->run(*W, *TheFAM);
+ }
+ return W;
+}
+
+static llvm::Value *EmitParallelFor(llvm::ArrayRef<ExprAST *> Args) {
+ if (Args.size() != 3 && Args.size() != 4) {
+   return LogErrorV("Incorrect # args passed");
+ }
+ auto *FnRef = dynamic_cast<VariableExprAST *>(Args[2]);
+ llvm::Function *F = FnRef ? getFunction(FnRef->getSymbol()) : nullptr;
+ if (!F || F->arg_size() != 1 || F->getArg(0)->getType() != llvm::Type::getDoubleTy(*TheContext)) {
+   return LogErrorV("pfor() expects the name of a function of one number as third argument");
+ }
+
+ llvm::Value *Lo = Args[0]->codegen();
+ llvm::Value *Hi = Args[1]->codegen();
+ llvm::Value *Grain = Args.size() == 4 ? Args[3]->codegen()
+                                       : llvm::ConstantFP::get(*TheContext, llvm::APFloat(0.0));
+ if (!Lo || !Hi || !Grain) {
+   return nullptr;
+ }
+ if (isArray(Lo) || isArray(Hi) || isArray(Grain)) {
+   return LogErrorV("pfor() bounds must be numbers");
+ }
+ return Builder->CreateCall(getRuntimeFunction("bl_pfor"),
+                            {Lo, Hi, Grain, getPforChunkFunction(F)}, "pfortmp");
+}
+// END PARALLEL FOR
+
+// BEGIN BATCH EVALUATION
+/*
+  Columnar entry point of a function 'fn f(a b ...)' of numbers:
+
+    void f.batch(const double **Columns, double *Out, i64 Rows)
+
+  sets Out[k] = f(Columns[0][k], Columns[1][k], ...) for every row. The loop is
+  emitted into f's module, so the module pipeline can inline f into it and the
+  loop vectorizer widen it; the caller pays one call for all rows instead of one
+  per row. '.' can't appear in an identifier, so the name never clashes.
+*/
+static llvm::Function *EmitBatchFunction(llvm::Function *F) {
+ llvm::Type *DoubleTy = llvm::Type::getDoubleTy(*TheContext);
+ llvm::Type *DoublePtr = llvm::Type::getDoublePtrTy(*TheContext);
+ llvm::Type *I64 = llvm::Type::getInt64Ty(*TheContext);
+ llvm::Function *W = llvm::Function::Create(
+     llvm::FunctionType::get(llvm::Type::getVoidTy(*TheContext),
+                             {DoublePtr->getPointerTo(), DoublePtr, I64}, false),
+     llvm::Function::ExternalLinkage, F->getName() + ".batch", TheModule.get());
+ llvm::IRBuilderBase::InsertPointGuard Guard(*Builder);
+ Builder->SetInsertPoint(llvm::BasicBlock::Create(*TheContext, "entry", W));
+
+ std::vector<llvm::Value *> Columns;
+ for (unsigned i = 0; i < F->arg_size(); ++i) {
+   llvm::Value *Slot = Builder->CreateConstInBoundsGEP1_64(DoublePtr, W->getArg(0), i);
+   Columns.push_back(Builder->CreateLoad(DoublePtr, Slot, "col"));
+ }
+ EmitCountedLoop(W->getArg(2), [&](llvm::Value *K) {
+   std::vector<llvm::Value *> Args;
+   for (llvm::Value *Col : Columns) {
+     Args.push_back(Builder->CreateLoad(DoubleTy, Builder->CreateInBoundsGEP(DoubleTy, Col, K), "x"));
+   }
+   llvm::Value *Y = CreateUserCall(F, Args, "y");
+   Builder->CreateStore(Y, Builder->CreateInBoundsGEP(DoubleTy, W->getArg(1), K));
+   return true;
+ });
+ Builder->CreateRetVoid();
+
+ llvm::verifyFunction(*W);
+ if (TheFPM) {
+   PhaseTimer T(CompileStats::Optimize);
+   TheFPM->run(*W, *TheFAM);
+ }
+ return W;
+}
+// END BATCH EVALUATION
+
+// BEGIN MEMOIZATION
+/*
+  fn memo fib(n) ...
+
+  A 'memo' function looks its argument values up in a bounded cache owned by the
+  runtime (bl_memo_lookup) before running the body, and returns the cached result
+  on a hit. On a miss the body runs and its result is stored (bl_memo_store). The
+  cache handle lives in a module global __memo.<name> that the runtime fills in on
+  first use, so the generated code holds no host addresses and stays cacheable.
+  The global is exported so that a Compiler can look it up and free the table
+  together with the code (see LIBRARY API). The body must not depend on anything
+  but its arguments.
+*/
+struct MemoState {
+  llvm::Value *Slot = nullptr; // i8** __memo.<name>
+  llvm::Value *Key = nullptr;  // double* to the argument values on entry
+};
+
+// * Emits the cache probe at the start of F. Afterwards the builder is positioned
+//   in a new block where the body goes, the hit path has already returned.
+static bool EmitMemoLookup(llvm::Function *F, MemoState &Memo) {
+ llvm::Type *DoubleTy = llvm::Type::getDoubleTy(*TheContext);
+ for (auto &Arg : F->args()) {
+   if (Arg.getType() != DoubleTy) {
+     LogErrorV("memo functions take numbers only");
+     return false;
+   }
+ }
+
+ llvm::Type *I8Ptr = llvm::Type::getInt8PtrTy(*TheContext);
+ auto *Slot = new llvm::GlobalVariable(*TheModule, I8Ptr, false, llvm::GlobalValue::ExternalLinkage,
+                                       llvm::ConstantPointerNull::get(llvm::cast<llvm::PointerType>(I8Ptr)),
+                                       "__memo." + F->getName());
+
+ unsigned N = F->arg_size();
+ llvm::Type *KeyTy = llvm::ArrayType::get(DoubleTy, std::max(N, 1u));
+ llvm::AllocaInst *Key = CreateEntryBlockAlloca(F, "memo.key", KeyTy);
+ for (auto &Arg : F->args()) {
+   Builder->CreateStore(&Arg, Builder->CreateConstInBoundsGEP2_32(KeyTy, Key, 0, Arg.getArgNo()));
+ }
+ llvm::AllocaInst *Cached = CreateEntryBlockAlloca(F, "memo.val");
+
+ Memo.Slot = Slot;
+ Memo.Key = Builder->CreateConstInBoundsGEP2_32(KeyTy, Key, 0, 0, "memo.keyptr");
+ llvm::Value *Hit = Builder->CreateCall(
+     getRuntimeFunction("bl_memo_lookup"),
+     {Slot, Builder->CreateGlobalStringPtr(F->getName(), "memo.name"),
+      llvm::ConstantInt::get(llvm::Type::getInt64Ty(*TheContext), N), Memo.Key, Cached},
+     "memo.hit");
+
+ llvm::BasicBlock *HitBB = llvm::BasicBlock::Create(*TheContext, "memo.hit", F);
+ llvm::BasicBlock *BodyBB = llvm::BasicBlock::Create(*TheContext, "memo.miss", F);
+ Builder->CreateCondBr(Builder->CreateICmpNE(Hit, llvm::ConstantInt::get(Hit->getType(), 0)),
+                       HitBB, BodyBB);
+ Builder->SetInsertPoint(HitBB);
+ Builder->CreateRet(Builder->CreateLoad(DoubleTy, Cached, "memo.val"));
+ Builder->SetInsertPoint(BodyBB);
+ return true;
+}
+
+// * Stores the body's result, emitted right before the miss path returns.
+static void EmitMemoStore(const MemoState &Memo, llvm::Value *RetVal) {
+ Builder->CreateCall(getRuntimeFunction("bl_memo_store"), {Memo.Slot, Memo.Key, RetVal});
+}
+// END MEMOIZATION
+
+// BEGIN CONDITIONALS AND TAIL CALLS
+/*
+  'if' is lowered to a select when both branches are cheap and can't have effects
+  or fail, so evaluating the untaken one is harmless; otherwise to branches and a
+  phi. The limit is in "operations", roughly the point where a mispredicted branch
+  costs more than computing both sides.
+*/
+static const unsigned MaxSelectCost = 6;
+
+// * Cost of evaluating E speculatively, or ~0u if it must not be (calls, stores,
+//   loops, array indexing).
+static unsigned SpeculationCost(ExprAST *E) {
+ if (dynamic_cast<NumberExprAST *>(E)) {
+   return 0;
+ }
+ if (dynamic_cast<VariableExprAST *>(E)) {
+   return 1;
+ }
+ unsigned Cost = ~0u;
+ if (auto *B = dynamic_cast<BinaryExprAST *>(E)) {
+   unsigned L = SpeculationCost(B->getLHS()), R = SpeculationCost(B->getRHS());
+   if (L != ~0u && R != ~0u && isBuiltinBinop(B->getOp())) { // user operators are calls
+     Cost = 1 + L + R;
+   }
+ } else if (auto *I = dynamic_cast<IfExprAST *>(E)) {
+   unsigned C = SpeculationCost(I->getCond()), T = SpeculationCost(I->getThen()),
+            F = SpeculationCost(I->getElse());
+   if (C != ~0u && T != ~0u && F != ~0u) {
+     Cost = 1 + C + T + F;
+   }
+ }
+ return Cost;
+}
+
+/*
+  Self-recursive calls whose value the function returns are turned into guaranteed
+  tail calls (musttail), so recursion like
+
+    fn loop(n acc) if n < 1 then acc else loop(n - 1, acc + n);
+
+  runs in constant stack space at every -O level; TailCallElimPass further turns
+  them into loops from -O1. Branches of an 'if' meet in a phi that is returned, so
+  first every block that only does 'ret phi' is folded into its predecessors: each
+  of them returns its own incoming value instead of branching there. A function
+  that releases arrays or stores a memo result before returning keeps its calls
+  as they are, they aren't in tail position.
+*/
+static void EmitSelfTailCalls(llvm::Function *F) {
+ bool Changed = true;
+ while (Changed) {
+   Changed = false;
+   for (llvm::BasicBlock &BB : *F) {
+     auto *Ret = llvm::dyn_cast<llvm::ReturnInst>(BB.getTerminator());
+     auto *Phi = Ret ? llvm::dyn_cast_or_null<llvm::PHINode>(Ret->getReturnValue()) : nullptr;
+     if (!Phi || &BB.front() != Phi || Phi->getNextNode() != Ret) {
+       continue;
+     }
+     for (llvm::BasicBlock *Pred : llvm::to_vector<4>(llvm::predecessors(&BB))) {
+       auto *Br = llvm::dyn_cast<llvm::BranchInst>(Pred->getTerminator());
+       if (!Br || !Br->isUnconditional()) {
+         continue;
+       }
+       llvm::ReturnInst::Create(*TheContext, Phi->getIncomingValueForBlock(Pred), Br);
+       Br->eraseFromParent();
+       Phi->removeIncomingValue(Pred, /*DeletePHIIfEmpty=*/false);
+       Changed = true;
+     }
+     if (llvm::pred_empty(&BB)) {
+       BB.eraseFromParent();
+     }
+     if (Changed) {
+       break; // the block list changed, start over
+     }
+   }
+ }
+
+ for (llvm::BasicBlock &BB : *F) {
+   auto *Ret = llvm::dyn_cast<llvm::ReturnInst>(BB.getTerminator());
+   auto *Call = Ret ? llvm::dyn_cast_or_null<llvm::CallInst>(Ret->getReturnValue()) : nullptr;
+   if (Call && Call->getCalledFunction() == F && Call->getNextNode() == Ret) {
+     Call->setTailCallKind(llvm::CallInst::TCK_MustTail);
+   }
+ }
+}
+// END CONDITIONALS AND TAIL CALLS
+
+llvm::Value *NumberExprAST::codegen() {
+ return llvm::ConstantFP::get(*TheContext, llvm::APFloat(Val));
+}
+llvm::Value *VariableExprAST::codegen() {
+ llvm::AllocaInst *A = NamedValues.lookup(Name);
+ if (!A) {
+   return LogErrorV("Unknown variable name");
+ }
+ return Builder->CreateLoad(A->getAllocatedType(), A, Symbols.getName(Name));
+}
+
+llvm::Value *BinaryExprAST::codegen() {
+ llvm::Value *L = LHS->codegen();
+ llvm::Value *R = RHS->codegen();
+ if(!L || !R) {
+   return nullptr;
+ }
+ if (Op == ':') { // sequencing, evaluates both sides and yields the right one
+   return R;
+ }
+ if (isArray(L) || isArray(R)) {
+   return LogErrorV("arithmetic on an array");
+ }
+
+ switch (Op) {
+   case '+' :
+     return Builder->CreateFAdd(L, R, "addtmp");
+   case '-':
+     return Builder->CreateFSub(L, R, "subtmp");
+   case '*':
+     return Builder->CreateFMul(L, R, "multmp");
+   case '<':
+     L = Builder->CreateFCmpULT(L, R, "cmptmp");
+     return Builder->CreateUIToFP(L, llvm::Type::getDoubleTy(*TheContext), "booltmp");
+   default:
+     break;
+ }
+
+ // A user-defined operator, a call of its 'binary<c>' function.
+ Symbol OpFn = BinopFunctions[static_cast<unsigned char>(Op)];
+ llvm::Function *F = OpFn ? getFunction(OpFn) : nullptr;
+ if (!F) {
+   return LogErrorV("invalid binary operator");
+ }
+ return CreateUserCall(F, {L, R}, "binop");
+}
+llvm::Value *IndexExprAST::codegen() {
+ llvm::AllocaInst *A = NamedValues.lookup(Name);
+ if (!A) {
+   return LogErrorV("Unknown variable name");
+ }
+ if (A->getAllocatedType() != getArrayTy()) {
+   return LogErrorV("indexing a variable that is not an array");
+ }
+ llvm::Value *Idx = Index->codegen();
+ if (!Idx) {
+   return nullptr;
+ }
+ llvm::Value *Arr = Builder->CreateLoad(getArrayTy(), A, Symbols.getName(Name));
+ return LoadElement(Arr, ToIndex(Idx));
+}
+
+llvm::Value *AssignExprAST::codegen() {
+ llvm::Value *Val = Expr->codegen();
+ if (!Val)
+   return nullptr;
+
+ if (Index) { // xs[i] = v
+   llvm::AllocaInst *A = NamedValues.lookup(VarName);
+   if (!A || A->getAllocatedType() != getArrayTy())
+     return LogErrorV("indexing a variable that is not an array");
+   if (isArray(Val))
+     return LogErrorV("storing an array into an array element");
+   llvm::Value *Idx = Index->codegen();
+   if (!Idx)
+     return nullptr;
+   llvm::Value *Arr = Builder->CreateLoad(getArrayTy(), A, Symbols.getName(VarName));
+   Builder->CreateStore(Val, getElementPtr(Arr, ToIndex(Idx)));
+   return Val;
+ }
+
+ // The first assignment to a name declares it, with the type of the value.
+ llvm::AllocaInst *A = NamedValues.lookup(VarName);
+ if (!A) {
+   A = CreateEntryBlockAlloca(Builder->GetInsertBlock()->getParent(), Symbols.getName(VarName),
+                              Val->getType());
+   NamedValues.bind(VarName, A);
+ } else if (A->getAllocatedType() != Val->getType()) {
+   return LogErrorV("assigning a value of a different type");
+ }
+ Builder->CreateStore(Val, A);
+ return Val;
+}
+// * The loop variable is derived from the counted loop's integer induction
+//   variable as i = start + k * step, see EmitCountedLoop.
+llvm::Value *ForExprAST::codegen() {
+ llvm::Value *StartVal = Start->codegen();
+ llvm::Value *EndVal = End->codegen();
+ llvm::Value *StepVal = Step ? Step->codegen()
+                             : llvm::ConstantFP::get(*TheContext, llvm::APFloat(1.0));
+ if (!StartVal || !EndVal || !StepVal) {
+   return nullptr;
+ }
+ if (isArray(StartVal) || isArray(EndVal) || isArray(StepVal)) {
+   return LogErrorV("for loop bounds must be numbers");
+ }
+
+ // Trip count: ceil((end - start) / step), none if that isn't positive.
+ llvm::Type *I64 = llvm::Type::getInt64Ty(*TheContext);
+ llvm::Value *Span = Builder->CreateFDiv(Builder->CreateFSub(EndVal, StartVal, "span"),
+                                         StepVal, "span");
+ Span = Builder->CreateUnaryIntrinsic(llvm::Intrinsic::ceil, Span);
+ llvm::Value *HasTrips = Builder->CreateFCmpOGT(
+     Span, llvm::ConstantFP::get(*TheContext, llvm::APFloat(0.0)), "hastrips");
+ llvm::Value *TripCount = Builder->CreateSelect(
+     HasTrips, Builder->CreateFPToSI(Span, I64), llvm::ConstantInt::get(I64, 0), "tripcount");
+
+ // The loop variable shadows any outer variable of the same name for the body,
+ // names first assigned in the body go out of scope after the loop.
+ llvm::Function *TheFunction = Builder->GetInsertBlock()->getParent();
+ size_t Scope = NamedValues.mark();
+ llvm::AllocaInst *VarAlloca = CreateEntryBlockAlloca(TheFunction, Symbols.getName(VarName));
+ NamedValues.bind(VarName, VarAlloca);
+
+ bool OK = EmitCountedLoop(TripCount, [&](llvm::Value *K) {
+   llvm::Value *IndVar = Builder->CreateFAdd(
+       StartVal, Builder->CreateFMul(Builder->CreateSIToFP(K, StartVal->getType()), StepVal),
+       Symbols.getName(VarName));
+   Builder->CreateStore(IndVar, VarAlloca);
+   return Body->codegen() != nullptr;
+ });
+ NamedValues.restore(Scope);
+ if (!OK) {
+   return nullptr;
+ }
+
+ return llvm::Constant::getNullValue(llvm::Type::getDoubleTy(*TheContext));
+}
+
+llvm::Value *IfExprAST::codegen() {
+ llvm::Value *CondV = Cond->codegen();
+ if (!CondV) {
+   return nullptr;
+ }
+ if (isArray(CondV)) {
+   return LogErrorV("if condition must be a number");
+ }
+ CondV = Builder->CreateFCmpONE(CondV, llvm::ConstantFP::get(*TheContext, llvm::APFloat(0.0)), "ifcond");
+
+ // Names first assigned in a branch are local to that branch.
+ size_t Scope = NamedValues.mark();
+
+ unsigned ThenCost = SpeculationCost(Then), ElseCost = SpeculationCost(Else);
+ if (ThenCost != ~0u && ElseCost != ~0u && ThenCost + ElseCost <= MaxSelectCost) {
+   llvm::Value *ThenV = Then->codegen();
+   llvm::Value *ElseV = Else->codegen();
+   NamedValues.restore(Scope);
+   if (!ThenV || !ElseV) {
+     return nullptr;
+   }
+   if (ThenV->getType() != ElseV->getType()) {
+     return LogErrorV("if branches have different types");
+   }
+   return Builder->CreateSelect(CondV, ThenV, ElseV, "iftmp");
+ }
+
+ llvm::Function *TheFunction = Builder->GetInsertBlock()->getParent();
+ llvm::BasicBlock *ThenBB = llvm::BasicBlock::Create(*TheContext, "then", TheFunction);
+ llvm::BasicBlock *ElseBB = llvm::BasicBlock::Create(*TheContext, "else", TheFunction);
+ llvm::BasicBlock *MergeBB = llvm::BasicBlock::Create(*TheContext, "ifcont", TheFunction);
+ Builder->CreateCondBr(CondV, ThenBB, ElseBB);
+
+ Builder->SetInsertPoint(ThenBB);
+ llvm::Value *ThenV = Then->codegen();
+ NamedValues.restore(Scope);
+ if (!ThenV) {
+   return nullptr;
+ }
+ Builder->CreateBr(MergeBB);
+ ThenBB = Builder->GetInsertBlock(); // codegen of Then may have added blocks
+
+ Builder->SetInsertPoint(ElseBB);
+ llvm::Value *ElseV = Else->codegen();
+ NamedValues.restore(Scope);
+ if (!ElseV) {
+   return nullptr;
+ }
+ if (ThenV->getType() != ElseV->getType()) {
+   return LogErrorV("if branches have different types");
+ }
+ Builder->CreateBr(MergeBB);
+ ElseBB = Builder->GetInsertBlock();
+
+ Builder->SetInsertPoint(MergeBB);
+ llvm::PHINode *PN = Builder->CreatePHI(ThenV->getType(), 2, "iftmp");
+ PN->addIncoming(ThenV, ThenBB);
+ PN->addIncoming(ElseV, ElseBB);
+ return PN;
+}
+
+llvm::Value *CallExprAST::codegen() {
+ if (isArrayBuiltin(Callee)) {
+   return EmitArrayBuiltin(Callee, Args);
+ }
+ if (Callee == Sym_pfor) {
+   return EmitParallelFor(Args);
+ }
+
+ // Look up the name in the global module table, or a known prototype.
+ llvm::Function *CalleeF = getFunction(Callee);
+ if (!CalleeF) {
+   return LogErrorV("Unknown Function Referenced");
+ }
+
+ if (CalleeF->arg_size() != Args.size()) {
+   return LogErrorV("Incorrect # args passed");
+ }
+ std::vector<llvm::Value*> ArgsV;
+ for (unsigned i {0}, e = Args.size(); i != e; ++i) {
+   ArgsV.push_back(Args[i]->codegen());
+   if(!ArgsV.back()) {
+     return nullptr;
+   }
+   if (ArgsV.back()->getType() != CalleeF->getArg(i)->getType()) {
+     return LogErrorV(isArray(ArgsV.back()) ? "array passed for a number argument"
+                                            : "number passed for an array argument");
+   }
+ }
+ return CreateUserCall(CalleeF, ArgsV, "calltmp");
+}
+
+llvm::Function *PrototypeAST::codegen() {
+ PhaseTimer T(CompileStats::Codegen);
+ std::vector<llvm::Type *> Params(Args.size(), llvm::Type::getDoubleTy(*TheContext));
+ for (unsigned i = 0; i < ArrayArgs.size(); ++i) {
+   if (ArrayArgs[i]) {
+     Params[i] = getArrayTy();
+   }
+ }
+ llvm::FunctionType *FT = llvm::FunctionType::get(llvm::Type::getDoubleTy(*TheContext), Params, false);
+
+ llvm::Function *F = llvm::Function::Create(FT, llvm::Function::ExternalLinkage, getName(),
+                                            TheModule.get());
+ if (BinaryOp) {
+   F->addFnAttr(llvm::Attribute::AlwaysInline); // inlined at every use, even at -O0
+ }
+ if (VectorVariants) {
+   F->setDoesNotAccessMemory();
+   for (unsigned W : VectorVariantWidths) {
+     getVectorVariant(F, W);
+   }
+ }
+ unsigned idx = 0;
+ for (auto &Arg : F->args()) {
+   Arg.setName(Symbols.getName(Args[idx++]));
+ }
+ return F;
+}
+ 
+llvm::Function *FunctionAST::codegen() {
+ PhaseTimer T(CompileStats::Codegen);
+ llvm::Function *TheFunction = TheModule->getFunction(Proto->getName());
+
+ if(!TheFunction) {
+   TheFunction = Proto->codegen();
+ }
+ 
+ if(!TheFunction) {
+   return nullptr;
+ }
+ 
+ llvm::BasicBlock *BB = llvm::BasicBlock::Create(*TheContext, "entry", TheFunction);
+ Builder->SetInsertPoint(BB);
+
+ // Fast-math flags for every FP operation of the body, from the command line or
+ // the function's own 'fastmath' attribute.
+ llvm::FastMathFlags FMF = GlobalFMF;
+ if (Proto->hasAttr(FnAttr_FastMath)) {
+   FMF.setFast();
+ }
+ Builder->setFastMathFlags(FMF);
+ if (FMF.isFast()) {
+   TheFunction->addFnAttr("unsafe-fp-math", "true");
+   TheFunction->addFnAttr("no-nans-fp-math", "true");
+   TheFunction->addFnAttr("no-infs-fp-math", "true");
+   TheFunction->addFnAttr("no-signed-zeros-fp-math", "true");
+   TheFunction->addFnAttr("approx-func-fp-math", "true");
+ }
+
+ // Arguments are mutable like any other local: spill each into its own slot.
+ if (TheFunction->arg_size() != Proto->getArgs().size()) {
+   TheFunction->eraseFromParent();
+   LogErrorV("definition has a different # args than the declaration");
+   return nullptr;
+ }
+ NamedValues.clear();
+ for (auto &Arg : TheFunction->args()) {
+   llvm::AllocaInst *A = CreateEntryBlockAlloca(TheFunction, Arg.getName(), Arg.getType());
+   Builder->CreateStore(&Arg, A);
+   NamedValues.bind(Proto->getArgs()[Arg.getArgNo()], A);
+ }
+ MemoState Memo;
+ if (Proto->hasAttr(FnAttr_Memo) && !EmitMemoLookup(TheFunction, Memo)) {
+   TheFunction->eraseFromParent();
+   return nullptr;
+ }
+ llvm::Value *RetVal = Body->codegen();
+ if (RetVal && isArray(RetVal)) {
+   RetVal = LogErrorV("functions must return a number");
+ }
+ if (RetVal) {
+   // Arrays created by this function are released when it returns.
+   llvm::Function *AllocF = TheModule->getFunction("bl_array_alloc");
+   if (AllocF && llvm::any_of(AllocF->users(), [&](llvm::User *U) {
+         return llvm::cast<llvm::Instruction>(U)->getFunction() == TheFunction;
+       })) {
+     llvm::IRBuilder<> TmpB(&TheFunction->getEntryBlock(), TheFunction->getEntryBlock().begin());
+     llvm::Value *Mark = TmpB.CreateCall(getRuntimeFunction("bl_array_mark"), {}, "mark");
+     Builder->CreateCall(getRuntimeFunction("bl_array_release"), {Mark});
+   }
+   if (Memo.Slot) {
+     EmitMemoStore(Memo, RetVal);
+   }
+
+   Builder->CreateRet(RetVal);
+   EmitSelfTailCalls(TheFunction);
+
+   llvm::verifyFunction(*TheFunction);
+   
+   // Run the optimizer on the function.
+   if (TheFPM) {
+       PhaseTimer T(CompileStats::Optimize);
+       TheFPM->run(*TheFunction, *TheFAM);
+   }
+   if (EmitVectorVariants(TheFunction)) {
+     Proto->setVectorVariants();
+   }
+
+   return TheFunction;
+ }
+ // Error reading body, remove function.
+ TheFunction->eraseFromParent();
+ return nullptr;
+}
+
+// BEGIN REMARKS
+// * Prints the optimization remarks of passes whose name matches --remarks=<regex>,
+//   e.g. --remarks=loop-vectorize reports every loop the vectorizer widened or gave up on.
+struct RemarkFilter : public llvm::DiagnosticHandler {
+  llvm::Regex Passes;
+
+  RemarkFilter(llvm::StringRef Pattern) : Passes(Pattern) {}
+
+  bool isAnalysisRemarkEnabled(llvm::StringRef PassName) const override { return Passes.match(PassName); }
+  bool isMissedOptRemarkEnabled(llvm::StringRef PassName) const override { return Passes.match(PassName); }
+  bool isPassedOptRemarkEnabled(llvm::StringRef PassName) const override { return Passes.match(PassName); }
+  bool isAnyRemarkEnabled() const override { return true; }
+};
+// END REMARKS
+
+// BEGIN SOURCE INPUT
+/*
+  The lexer reads from a SourceBuffer instead of pulling characters through
+  getchar(). A source exposes a window [begin(), end()) of contiguous characters
+  and is asked to refill() once the lexer reaches the end of it, so identifiers
+  and numbers can be handed out as views straight into the window.
+*/
+class SourceBuffer {
+protected:
+  // [1st] Window of characters currently available to the lexer.
+
+  const char *BufStart = nullptr, *BufEnd = nullptr; // [1st]
+
+public:
+  // [1st] * Virtual destructor so sources can be owned through a base pointer.
+  // [2nd] * Bounds of the current window.
+  // [3rd] * Makes more input available. The last Keep characters of the current window
+  //         (the token being lexed) are kept at the start of the new window.
+  //         Returns false once the input is exhausted.
+
+  virtual ~SourceBuffer() = default; // [1st]
+
+  const char *begin() const { return BufStart; } // [2nd]
+  const char *end() const { return BufEnd; }
+
+  virtual bool refill(size_t Keep) { return false; } // [3rd]
+};
+
+// * Whole input in one llvm::MemoryBuffer: a file (mmap'd by LLVM when large enough)
+//   or an in-memory string. Never needs a refill.
+class MemorySource : public SourceBuffer {
+private:
+  std::unique_ptr<llvm::MemoryBuffer> Buffer;
+
+public:
+  MemorySource(std::unique_ptr<llvm::MemoryBuffer> Buf) : Buffer(std::move(Buf)) {
+    BufStart = Buffer->getBufferStart();
+    BufEnd = Buffer->getBufferEnd();
+  }
+
+  static std::unique_ptr<SourceBuffer> fromString(llvm::StringRef Source) {
+    return std::make_unique<MemorySource>(llvm::MemoryBuffer::getMemBufferCopy(Source, "<string>"));
+  }
+
+  // Returns nullptr (after reporting why) if the file can't be opened.
+  static std::unique_ptr<SourceBuffer> fromFile(llvm::StringRef Path) {
+    auto BufOrErr = llvm::MemoryBuffer::getFile(Path, /*IsText=*/false,
+                                                /*RequiresNullTerminator=*/false);
+    if (!BufOrErr) {
+      llvm::errs() << "Error: can't open " << Path << ": " << BufOrErr.getError().message() << '\n';
+      return nullptr;
+    }
+    return std::make_unique<MemorySource>(std::move(*BufOrErr));
+  }
+};
+
+// * Reads stdin in large blocks. A read returns as soon as a line is available on a
+//   terminal, so the REPL stays interactive.
+class StdinSource : public SourceBuffer {
+private:
+  static constexpr size_t BlockSize = 64 * 1024;
+  std::vector<char> Storage;
+
+public:
+  StdinSource() : Storage(BlockSize) {
+    BufStart = BufEnd = Storage.data();
+  }
+
+  bool refill(size_t Keep) override {
+    // Move the partial token to the front, growing the buffer if a single token
+    // doesn't leave room for another block.
+    size_t Offset = BufEnd - Keep - Storage.data();
+    std::memmove(Storage.data(), Storage.data() + Offset, Keep);
+    if (Storage.size() - Keep < BlockSize)
+      Storage.resize(Keep + BlockSize);
+
+    llvm::Expected<size_t> Read = llvm::sys::fs::readNativeFile(
+        llvm::sys::fs::getStdinHandle(),
+        llvm::MutableArrayRef<char>(Storage.data() + Keep, Storage.size() - Keep));
+    size_t N = 0;
+    if (Read) {
+      N = *Read;
+    } else {
+      llvm::consumeError(Read.takeError());
+    }
+    BufStart = Storage.data();
+    BufEnd = Storage.data() + Keep + N;
+    return N != 0;
+  }
+};
+// END SOURCE INPUT
+
+// BEGIN JIT
+// * Hands the current module to the JIT. The context stays shared with the modules
+//   created after it; the JIT compiles on the thread that looks a symbol up, so
+//   the context is never used by two threads at once. With a tracker RT, the
+//   module's code and symbols are freed again by RT->remove().
+static llvm::Error AddModuleToJIT(llvm::orc::ResourceTrackerSP RT = nullptr) {
+  PhaseTimer T(CompileStats::JIT);
+  ++Stats.JITModules;
+  llvm::orc::ThreadSafeModule TSM(std::move(TheModule), TheTSC);
+  return RT ? TheJIT->addIRModule(RT, std::move(TSM)) : TheJIT->addIRModule(std::move(TSM));
+}
+
+// * Address of a JIT symbol. The first lookup of a symbol compiles its module.
+static llvm::Expected<llvm::JITTargetAddress> LookupInJIT(llvm::StringRef Name) {
+  PhaseTimer T(CompileStats::JIT);
+  auto Sym = TheJIT->lookup(Name);
+  if (!Sym) {
+    return Sym.takeError();
+  }
+  return Sym->getAddress();
+}
+// END JIT
+
+struct lexer {
+   // [1st] Spelling of the last identifier / number, a view into the source window.
+   //       Only valid until the next call to gettok(). IdentifierSym is the interned
+   //       identifier, valid for good.
+   llvm::StringRef IdentifierStr;
+   Symbol IdentifierSym = 0;
+   double NumVal;
+   int CurTok;
+
+   // [2nd] Input, and the lexer's position inside the source's current window.
+   std::unique_ptr<SourceBuffer> Source;
+   const char *Cur, *End;
+
+   lexer() : lexer(std::make_unique<StdinSource>()) {}
+   lexer(std::unique_ptr<SourceBuffer> Src)
+       : NumVal(0), CurTok(0), Source(std::move(Src)) { // Initialize CurTok
+     Cur = Source->begin();
+     End = Source->end();
+   }
+
+   // Asks the source for more input, keeping [TokStart, End) and relocating TokStart.
+   bool fill(const char *&TokStart) {
+     size_t Keep = End - TokStart;
+     size_t Offset = Cur - TokStart;
+     if (!Source->refill(Keep)) {
+       return false;
+     }
+     TokStart = Source->begin();
+     Cur = TokStart + Offset;
+     End = Source->end();
+     return Cur != End;
+   }
+
+   // Current character without consuming it, EOF at the end of input.
+   int peek(const char *&TokStart) {
+     if (Cur == End && !fill(TokStart)) {
+       return EOF;
+     }
+     return static_cast<unsigned char>(*Cur);
+   }
+   int peek() {
+     const char *TokStart = Cur;
+     return peek(TokStart);
+   }
+
+   int gettok() {
+     while (isspace(peek())) { ++Cur; }
+
+     int C = peek();
+     if (isalpha(C)) { 
+       const char *TokStart = Cur++;
+       while (isalnum(peek(TokStart))) {
+         ++Cur;
+       }
+       IdentifierStr = llvm::StringRef(TokStart, Cur - TokStart);
+       IdentifierSym = Symbols.intern(IdentifierStr);
+
+       // Keywords are the first symbols, in the order of PredefinedSymbol.
+       static const Token KeywordTokens[NumKeywordSymbols] = {
+           tok_def, tok_extern, tok_for, tok_in, tok_if, tok_then, tok_else};
+       if (IdentifierSym < NumKeywordSymbols) {
+         return KeywordTokens[IdentifierSym];
+       }
+       return tok_identifier;
+     }
+
+     if (isdigit(C) || C == '.') {
+       const char *TokStart = Cur++;
+       while (isdigit(C = peek(TokStart)) || C == '.') {
+         ++Cur;
+       }
+
+       // strtod needs a terminator; numbers are short enough to stay on the stack.
+       llvm::SmallString<32> NumStr(llvm::StringRef(TokStart, Cur - TokStart));
+       NumVal = std::strtod(NumStr.c_str(), nullptr);
+       return tok_number;
+     }
+
+     if (C == '#') { // Comment until end of line
+       do {
+         ++Cur;
+         C = peek();
+       } while (C != EOF && C != '\n' && C != '\r');
+
+       if (C != EOF) {
+         return gettok();
+       }
+     }
+
+     if (C == EOF) {
+       return tok_eof;
+     }
+
+     ++Cur;
+     return C;
+   }
+   llvm::StringRef getIdentifierStr() const { return IdentifierStr; }
+   Symbol getIdentifierSym() const { return IdentifierSym; }
+   double getNumVal() const { return NumVal; }
+   // void setCurTok(int tok) { CurTok = tok; } // Not used in this version
+   int getCurTok() const { return CurTok; }
+};
+
+class parser {
+ private:
+   lexer& m_lexer;
+
+   // Owns every AST node of the item currently being parsed / code generated.
+   ASTArena Arena;
+
+   // Rewrites each function body before codegen, keeps counters across items.
+   ASTSimplifier Simplifier{Arena};
+
+   // Top-level expressions evaluated by EvaluateConstant, without the JIT.
+   uint64_t NumConstantExprs = 0;
+
+   void simplify(FunctionAST &Fn) {
+     if (SimplifyAST) {
+       PhaseTimer T(CompileStats::ASTPasses);
+       Fn.simplify(Simplifier);
+     }
+   }
+
+   bool evaluateConstant(FunctionAST &Fn, double &Val) {
+     PhaseTimer T(CompileStats::ASTPasses);
+     return EvaluateConstant(Fn.getBody(), Val);
+   }
+
+   // The item has been code generated, drop all of its nodes at once.
+   void endItem() {
+     Stats.ASTNodes += Arena.getNodeCount();
+     Arena.reset();
+   }
+
+ public:
+   const ASTSimplifier::Counters &getSimplifyStats() const { return Simplifier.Stats; }
+   uint64_t getNumConstantExprs() const { return NumConstantExprs; }
+
+   parser(lexer& lexer_instance) : m_lexer(lexer_instance) {}
+
+   
+   int getTokPrecedence() {
+     int Tok = m_lexer.getCurTok();
+     if (Tok < 0 || Tok > 255) { // keywords, identifiers, numbers, eof
+       return -1;
+     }
+
+     // Make sure it's a declared binop.
+     int TokPrec = BinopPrecedence.Prec[Tok];
+     if (TokPrec <= 0) return -1;
+     return TokPrec;
+   }
+   
+   int getNextToken() {
+     PhaseTimer T(CompileStats::Lex);
+     ++Stats.Tokens;
+     return m_lexer.CurTok = m_lexer.gettok();
+   }
+
+   // Returns nullptr so it can terminate any Parse* routine, whatever it returns.
+   static std::nullptr_t LogError(const char *str)
+   {
+     errorStream() << "Error: " << str << '\n';
+     return nullptr;
+   }
+
+   ASTArena &getArena() { return Arena; }
+
+   ExprAST *ParsePrimary() {
+    switch(m_lexer.getCurTok()) {
+      default:
+        return LogError("Unknown token when expecting an expression");
+      case tok_identifier: {
+        auto LHS = ParseIdentifierExpr();
+        if (LHS && m_lexer.getCurTok() == '=') {
+          return ParseAssignmentExpr(LHS, *this);
+        }
+        return LHS;
+      }
+      case tok_number:
+        return ParseNumberExpr();
+      case '(':
+        return ParseParenExpr();
+      case tok_for:
+        return ParseForExpr();
+      case tok_if:
+        return ParseIfExpr();
+    }
+  }
+
+   ExprAST *ParseExpression() {
+     auto LHS = ParsePrimary();
+     if (!LHS) {
+       return nullptr;
+     }
+
+     return ParseBinOpRHS(0, LHS);
+   }
+
+   ExprAST *ParseNumberExpr() {
+     auto *Result = Arena.make<NumberExprAST>(m_lexer.getNumVal());
+     getNextToken(); // consume the number
+     return Result;
+   } 
+   
+   ExprAST *ParseParenExpr() {
+     getNextToken(); // eat (.
+     auto V = ParseExpression();
+     
+     if (!V) {
+       return nullptr;
+     }
+
+     if (m_lexer.getCurTok() != ')') {
+       return LogError("expected ')'");
+     }
+     
+     getNextToken(); // eat ).
+     return V;
+   }
+  ExprAST *ParseAssignmentExpr(ExprAST *LHS, parser &p) {
+    auto *Var = dynamic_cast<VariableExprAST*>(LHS);
+    auto *Elt = dynamic_cast<IndexExprAST*>(LHS);
+    if (!Var && !Elt)
+      return LogError("Expected a variable or array element before '='");
+    p.getNextToken(); // eat '='
+    // The value extends over everything but a ':' sequence: a = 1 : b is (a = 1) : b.
+    auto RHS = p.ParsePrimary();
+    if (RHS)
+      RHS = p.ParseBinOpRHS(BinopPrecedence.Prec[':'] + 1, RHS);
+    if (!RHS)
+      return nullptr;
+    if (Elt)
+      return Arena.make<AssignExprAST>(Elt->getSymbol(), RHS, Elt->getIndex());
+    return Arena.make<AssignExprAST>(Var->getSymbol(), RHS);
+  }
+   // forexpr ::= 'for' identifier '=' expr ',' expr (',' expr)? 'in' expression
+   ExprAST *ParseForExpr() {
+     getNextToken(); // eat for.
+
+     if (m_lexer.getCurTok() != tok_identifier) {
+       return LogError("expected identifier after for");
+     }
+     Symbol IdName = m_lexer.getIdentifierSym();
+     getNextToken(); // eat identifier.
+
+     if (m_lexer.getCurTok() != '=') {
+       return LogError("expected '=' after for");
+     }
+     getNextToken(); // eat '='.
+
+     auto *Start = ParseExpression();
+     if (!Start) {
+       return nullptr;
+     }
+     if (m_lexer.getCurTok() != ',') {
+       return LogError("expected ',' after for start value");
+     }
+     getNextToken();
+
+     auto *End = ParseExpression();
+     if (!End) {
+       return nullptr;
+     }
+
+     // The step value is optional.
+     ExprAST *Step = nullptr;
+     if (m_lexer.getCurTok() == ',') {
+       getNextToken();
+       Step = ParseExpression();
+       if (!Step) {
+         return nullptr;
+       }
+     }
+
+     if (m_lexer.getCurTok() != tok_in) {
+       return LogError("expected 'in' after for");
+     }
+     getNextToken(); // eat 'in'.
+
+     auto *Body = ParseExpression();
+     if (!Body) {
+       return nullptr;
+     }
+     return Arena.make<ForExprAST>(IdName, Start, End, Step, Body);
+   }
+
+   // ifexpr ::= 'if' expression 'then' expression 'else' expression
+   ExprAST *ParseIfExpr() {
+     getNextToken(); // eat if.
+
+     auto *Cond = ParseExpression();
+     if (!Cond) {
+       return nullptr;
+     }
+     if (m_lexer.getCurTok() != tok_then) {
+       return LogError("expected 'then' after if condition");
+     }
+     getNextToken(); // eat 'then'.
+
+     auto *Then = ParseExpression();
+     if (!Then) {
+       return nullptr;
+     }
+     if (m_lexer.getCurTok() != tok_else) {
+       return LogError("expected 'else' after then branch");
+     }
+     getNextToken(); // eat 'else'.
+
+     auto *Else = ParseExpression();
+     if (!Else) {
+       return nullptr;
+     }
+     return Arena.make<IfExprAST>(Cond, Then, Else);
+   }
+
+   ExprAST *ParseIdentifierExpr() {
+     Symbol IdName = m_lexer.getIdentifierSym();
+
+     getNextToken(); // eat identifier.
+
+     if (m_lexer.getCurTok() == '[') { // Array element.
+       getNextToken(); // eat [
+       auto *Index = ParseExpression();
+       if (!Index) {
+         return nullptr;
+       }
+       if (m_lexer.getCurTok() != ']') {
+         return LogError("Expected ']' after array index");
+       }
+       getNextToken(); // eat ]
+       return Arena.make<IndexExprAST>(IdName, Index);
+     }
+
+     if (m_lexer.getCurTok() != '(') { // Simple variable ref.
+       return Arena.make<VariableExprAST> (IdName);
+     }
+
+     // Call.
+     getNextToken(); // eat (
+     llvm::SmallVector<ExprAST *, 8> Args;
+     
+     if(m_lexer.getCurTok() != ')') {
+       while (true) {
+         if (auto *Arg = ParseExpression()) {
+           Args.push_back(Arg);
+         } else {
+           return nullptr;
+         }
+         if (m_lexer.getCurTok() == ')') {
+           break;
+         }
+         if (m_lexer.getCurTok() != ',') {
+           return LogError("Expected ')' or ',' in argument list");
+         }
+         getNextToken();
+       }
+     }
+     getNextToken(); // Eat the ')'.
+
+     return Arena.make<CallExprAST> (IdName, Arena.copyArray<ExprAST *>(Args));
+   }
+   ExprAST *ParseBinOpRHS(int ExprPrec, ExprAST *LHS) {
+     while (true) {
+       int TokPrec = getTokPrecedence();
+
+       if (TokPrec < ExprPrec) {
+         return LHS;
+       }
+
+       int BinOp = m_lexer.getCurTok();
+       getNextToken(); // eat binop
+
+       auto *RHS = ParsePrimary();
+       if (!RHS) {
+         return nullptr;
+       }
+
+       int NextTokPrec = getTokPrecedence();
+       if (TokPrec < NextTokPrec) {
+         RHS = ParseBinOpRHS(TokPrec + 1, RHS);
+         if (!RHS) {
+           return nullptr;
+         }
+       }
+       LHS = Arena.make<BinaryExprAST>(static_cast<char>(BinOp), LHS, RHS);
+     }
+   }
+   std::unique_ptr<PrototypeAST> ParsePrototype() {
+     if (m_lexer.getCurTok() != tok_identifier) {
+       return LogError("Expected function name in prototype!");
+     }
+     Symbol fnName = m_lexer.getIdentifierSym();
+     getNextToken();
+
+     // Identifiers before the actual name are function attributes.
+     unsigned Attrs = FnAttr_None;
+     while (m_lexer.getCurTok() == tok_identifier) {
+       FunctionAttr Attr = lookupFunctionAttr(Symbols.getName(fnName));
+       if (Attr == FnAttr_None) {
+         return LogError("Unknown function attribute in prototype!");
+       }
+       Attrs |= Attr;
+       fnName = m_lexer.getIdentifierSym();
+       getNextToken();
+     }
+
+     // binary<c> <precedence>: a user-defined operator.
+     char BinaryOp = 0;
+     unsigned Precedence = DefaultUserBinopPrecedence;
+     if (fnName == Sym_binary && m_lexer.getCurTok() != '(') {
+       if (!isUserBinopChar(m_lexer.getCurTok())) {
+         return LogError("Expected an operator character after 'binary'!");
+       }
+       BinaryOp = static_cast<char>(m_lexer.getCurTok());
+       fnName = Symbols.intern(std::string("binary") + BinaryOp);
+       if (getNextToken() == tok_number) {
+         double Prec = m_lexer.getNumVal();
+         if (Prec < 1 || Prec > 100) {
+           return LogError("Invalid precedence: must be 1..100");
+         }
+         Precedence = static_cast<unsigned>(Prec);
+         getNextToken();
+       }
+     }
+
+     if (m_lexer.getCurTok() != '(') {
+       return LogError("Expected '(' in prototype!");
+     }
+
+     std::vector<Symbol> ArgNames;
+     std::vector<bool> ArrayArgs;
+     // eat '(', then look for identifiers for arguments; 'name[]' is an array argument
+     getNextToken();
+     while (m_lexer.getCurTok() == tok_identifier) {
+       ArgNames.push_back(m_lexer.getIdentifierSym());
+       bool IsArray = false;
+       if (getNextToken() == '[') {
+         if (getNextToken() != ']') {
+           return LogError("Expected ']' after '[' in prototype!");
+         }
+         getNextToken(); // eat ']'
+         IsArray = true;
+       }
+       ArrayArgs.push_back(IsArray);
+     }
+     if (m_lexer.getCurTok() != ')') {
+       return LogError("Expected ')' in prototype!");
+     }
+     getNextToken(); // eat ')'
+
+     if (BinaryOp) {
+       if (ArgNames.size() != 2 || llvm::is_contained(ArrayArgs, true)) {
+         return LogError("A binary operator takes two numbers!");
+       }
+       // Usable from here on, including in its own body.
+       BinopPrecedence.Prec[static_cast<unsigned char>(BinaryOp)] = Precedence;
+       BinopFunctions[static_cast<unsigned char>(BinaryOp)] = fnName;
+     }
+     return std::make_unique<PrototypeAST> (fnName, std::move(ArgNames), Attrs, std::move(ArrayArgs),
+                                            BinaryOp, Precedence);
+   }
+   std::unique_ptr<FunctionAST> ParseDefinition() {
+     PhaseTimer T(CompileStats::Parse);
+     getNextToken(); // eat fn.
+     auto Proto = ParsePrototype();
+     if (!Proto) return nullptr;
+
+     if(auto *E = ParseExpression()) {
+       return std::make_unique<FunctionAST>(std::move(Proto), E);
+     }
+     return nullptr;
+   }
+   std::unique_ptr<PrototypeAST> ParseExtern() {
+     PhaseTimer T(CompileStats::Parse);
+     getNextToken(); // eat incl.
+     return ParsePrototype();
+   }
+   std::unique_ptr<FunctionAST> ParseTopLevelExpr(llvm::StringRef Name = "__anon_expr") {
+     PhaseTimer T(CompileStats::Parse);
+     if (auto *E = ParseExpression()) {
+       auto Proto = std::make_unique<PrototypeAST>(Symbols.intern(Name), std::vector<Symbol>());
+       return std::make_unique<FunctionAST>(std::move(Proto), E);
+     }
+     return nullptr;
+   }
+
+   // * Starts a new module. The context, IRBuilder, pass managers and analysis
+   //   registrations are made once and reused, so a module costs about as much as
+   //   the code put into it.
+   void InitializeModuleAndPassManager() {
+    // A module that wasn't handed to the JIT is still ours: drop it before its
+    // context can go. Analyses cached by the function passes are keyed by the
+    // functions of the previous module, which the JIT frees once it compiled them.
+    TheModule.reset();
+    if (TheFAM) {
+      TheLAM->clear();
+      TheFAM->clear();
+      TheCGAM->clear();
+      TheMAM->clear();
+    } else {
+      InitializePassManagers();
+    }
+
+    // Types and constants live as long as their context. Start a new one now and
+    // then so they don't pile up; the old one is freed with the last module in it.
+    if (!TheContext || ModulesInContext == ModulesPerContext) {
+      Builder.reset();
+      TheTSC = llvm::orc::ThreadSafeContext(std::make_unique<llvm::LLVMContext>());
+      TheContext = TheTSC.getContext();
+      ModulesInContext = 0;
+      if (!RemarksFilter.empty()) {
+        TheContext->setDiagnosticHandler(std::make_unique<RemarkFilter>(RemarksFilter));
+      }
+      Builder = std::make_unique<llvm::IRBuilder<>>(*TheContext);
+    }
+    ++ModulesInContext;
+
+    TheModule = std::make_unique<llvm::Module>("small_lang", *TheContext);
+    TheModule->setDataLayout(TheTM->createDataLayout());
+    TheModule->setTargetTriple(TheTM->getTargetTriple().str());
+   }
+
+   void InitializePassManagers() {
+    TheFPM = std::make_unique<llvm::FunctionPassManager>();
+    TheLAM = std::make_unique<llvm::LoopAnalysisManager>();
+    TheFAM = std::make_unique<llvm::FunctionAnalysisManager>();
+    TheCGAM = std::make_unique<llvm::CGSCCAnalysisManager>();
+    TheMAM = std::make_unique<llvm::ModuleAnalysisManager>();
+    ThePIC = std::make_unique<llvm::PassInstrumentationCallbacks>();
+    TheSI = std::make_unique<llvm::StandardInstrumentations>(/*DebugLogging=*/false);
+
+    TheSI->registerCallbacks(*ThePIC);
+    if (Stats.Enabled) {
+      Stats.registerCallbacks(*ThePIC);
+    }
+
+    // Cheap per-function cleanup as each function is generated; the full -O
+    // pipeline runs on the whole module when it is handed to the JIT. Locals are
+    // promoted out of their stack slots even at -O0.
+    TheFPM->addPass(llvm::PromotePass());
+    if (OptLevel > 0) {
+      TheFPM->addPass(llvm::InstCombinePass());
+      TheFPM->addPass(llvm::ReassociatePass());
+      TheFPM->addPass(llvm::SimplifyCFGPass());
+      TheFPM->addPass(llvm::TailCallElimPass());
+    }
+
+    llvm::PassBuilder PB(nullptr, llvm::PipelineTuningOptions(), llvm::None, ThePIC.get());
+    PB.registerModuleAnalyses(*TheMAM);
+    PB.registerFunctionAnalyses(*TheFAM);
+    PB.crossRegisterProxies(*TheLAM, *TheFAM, *TheCGAM, *TheMAM);
+    PB.registerCGSCCAnalyses(*TheCGAM);
+    PB.registerLoopAnalyses(*TheLAM);
+   }
+
+   void HandleDefinition() {
+     if (auto fnAST = ParseDefinition()) {
+       simplify(*fnAST);
+       if (auto *fnIR = fnAST->codegen()) {
+         llvm::outs() << "Parsed a function definition:\n";
+         fnIR->print(llvm::errs());
+         llvm::errs() << '\n';
+         // Later expressions are compiled in modules of their own and call it
+         // through a declaration.
+         auto Proto = fnAST->takeProto();
+         DefinedProtos[Proto->getSymbol()] = std::move(Proto);
+       }
+     } else {
+       // Skip token for error recovery.
+       getNextToken();
+     }
+   }
+   void HandleExtern() {
+     if(auto ProtoAST = ParseExtern()) {
+       if (auto *fnIR = ProtoAST->codegen()) {
+         llvm::outs() << "Parsed an extern:\n";
+         fnIR->print(llvm::errs());
+         llvm::errs() << '\n';
+         FunctionProtos[ProtoAST->getSymbol()] = std::move(ProtoAST); 
+       }
+     } else {
+       // Skip token for error recovery.
+       getNextToken();
+     }
+  }
+  void HandleTopLevelExpression() {
+    if (auto fnAST = ParseTopLevelExpr()) {
+        // Check if the top-level expression is an assignment
+        if (dynamic_cast<AssignExprAST*>(fnAST->getBody())) {
+            llvm::outs() << "Assignment at top level is not supported.\n";
+            return;
+        }
+        simplify(*fnAST);
+        double Val;
+        if (evaluateConstant(*fnAST, Val)) {
+            ++NumConstantExprs;
+            llvm::outs() << "Evaluated to: " << Val << "\n";
+            return;
+        }
+        // The functions defined since the last expression stay in the JIT for
+        // good; the expression gets a module of its own that is freed after it ran.
+        if (TheJIT && llvm::any_of(*TheModule, [](llvm::Function &F) { return !F.isDeclaration(); })) {
+            ExitOnErr(AddModuleToJIT());
+            InitializeModuleAndPassManager();
+        }
+        if (auto *fnIR = fnAST->codegen()) {  
+            llvm::outs() << "Parsed a top-level expr:\n";
+            fnIR->print(llvm::errs());
+            llvm::errs() << '\n';
+
+            if (TheJIT) {
+                auto RT = TheJIT->getMainJITDylib().createResourceTracker();
+                ExitOnErr(AddModuleToJIT(RT));
+
+                InitializeModuleAndPassManager(); 
+
+                auto Addr = ExitOnErr(LookupInJIT("__anon_expr"));
+                auto *FP = reinterpret_cast<double (*)()>(static_cast<uintptr_t>(Addr));
+                llvm::outs() << "Evaluated to: " << FP() << "\n";
+                ExitOnErr(RT->remove());
+            }
+        }
+    } else {
+        getNextToken();
+    }
+   }
+  void MainLoop() {
+    while (true) {
+      llvm::outs() << "ready> ";
+      switch (m_lexer.getCurTok()) { 
+        case tok_eof:
+          llvm::outs() << "Exiting.\n";
+          return;
+        case ';': // ignore top-level semicolons.
+          getNextToken();
+          break;
+        case tok_def:
+          HandleDefinition();
+          break;
+        case tok_extern:
+          HandleExtern();
+          break;
+        default:
+          HandleTopLevelExpression();
+          break;
+       }
+      endItem();
+     }
+   }
+
+  // * Parse-only driver for --bench-parse: no codegen and no JIT, returns the
+  //   number of AST nodes built for the whole input.
+  size_t BenchParse() {
+    size_t Nodes = 0;
+    while (m_lexer.getCurTok() != tok_eof) {
+      switch (m_lexer.getCurTok()) {
+        case ';':
+          getNextToken();
+          continue;
+        case tok_def:
+          if (!ParseDefinition()) getNextToken();
+          break;
+        case tok_extern:
+          if (!ParseExtern()) getNextToken();
+          break;
+        default:
+          if (!ParseTopLevelExpr()) getNextToken();
+          break;
+      }
+      Nodes += Arena.getNodeCount();
+      Arena.reset();
+    }
+    return Nodes;
+  }
+
+  // * Codegen driver for the stage benchmarks: generates every definition of the
+  //   input into the current module and adds the time spent in FunctionAST::codegen
+  //   alone (not parsing) to Elapsed. Returns the number of functions generated.
+  size_t BenchCodegen(std::chrono::duration<double> &Elapsed) {
+    size_t Functions = 0;
+    getNextToken();
+    while (m_lexer.getCurTok() != tok_eof) {
+      if (m_lexer.getCurTok() != tok_def) {
+        getNextToken();
+        continue;
+      }
+      if (auto fnAST = ParseDefinition()) {
+        auto Start = std::chrono::steady_clock::now();
+        Functions += fnAST->codegen() != nullptr;
+        Elapsed += std::chrono::steady_clock::now() - Start;
+      } else {
+        getNextToken();
+      }
+      Arena.reset();
+    }
+    return Functions;
+  }
+
+  // * A top-level expression compiled by CodegenItems(): the entry point to call,
+  //   or, if it was folded, none and its Value.
+  struct TopLevelExpr {
+    std::string Name;
+    double Value = 0;
+  };
+
+  // * Generates code for every item of the input into the current module, with no
+  //   prompt and no IR echo. Each top-level expression gets its own entry point,
+  //   listed in Exprs in source order; the prototypes of the functions defined are
+  //   moved to Defined. Returns false if any item had an error.
+  bool CodegenItems(std::vector<TopLevelExpr> &Exprs,
+                    std::vector<std::unique_ptr<PrototypeAST>> &Defined) {
+    bool HadError = false;
+
+    getNextToken();
+    while (m_lexer.getCurTok() != tok_eof) {
+      switch (m_lexer.getCurTok()) {
+        case ';':
+          getNextToken();
+          continue;
+        case tok_def:
+          if (auto fnAST = ParseDefinition()) {
+            simplify(*fnAST);
+            if (fnAST->codegen()) {
+              Defined.push_back(fnAST->takeProto());
+            } else {
+              HadError = true;
+            }
+          } else {
+            HadError = true;
+            getNextToken();
+          }
+          break;
+        case tok_extern:
+          if (auto ProtoAST = ParseExtern()) {
+            if (ProtoAST->codegen()) {
+              FunctionProtos[ProtoAST->getSymbol()] = std::move(ProtoAST);
+            } else {
+              HadError = true;
+            }
+          } else {
+            HadError = true;
+            getNextToken();
+          }
+          break;
+        default: {
+          std::string Name = "__anon_expr" + std::to_string(Exprs.size());
+          if (auto fnAST = ParseTopLevelExpr(Name)) {
+            if (dynamic_cast<AssignExprAST*>(fnAST->getBody())) {
+              errorStream() << "Error: Assignment at top level is not supported.\n";
+              HadError = true;
+            } else {
+              simplify(*fnAST);
+              double Val;
+              if (evaluateConstant(*fnAST, Val)) {
+                ++NumConstantExprs;
+                Exprs.push_back({"", Val});
+              } else if (fnAST->codegen()) {
+                Exprs.push_back({Name});
+              } else {
+                HadError = true;
+              }
+            }
+          } else {
+            HadError = true;
+            getNextToken();
+          }
+          break;
+        }
+      }
+      endItem();
+    }
+    return !HadError;
+  }
+
+  // * Batch driver for `basic-lang run`: every definition and top-level expression
+  //   of the input goes into the one module, which is handed to the JIT once; the
+  //   top-level expressions then run in source order. Returns the process exit code.
+  int RunBatch() {
+    std::vector<TopLevelExpr> Exprs;
+    std::vector<std::unique_ptr<PrototypeAST>> Defined;
+    if (!CodegenItems(Exprs, Defined)) {
+      return 1;
+    }
+
+    ExitOnErr(AddModuleToJIT());
+
+    for (const TopLevelExpr &E : Exprs) {
+      if (E.Name.empty()) {
+        continue; // folded: pure, and the value of a top-level expression is discarded here
+      }
+      auto *FP = reinterpret_cast<double (*)()>(static_cast<uintptr_t>(ExitOnErr(LookupInJIT(E.Name))));
+      FP();
+    }
+    return 0;
+  }
+};
+
+// BEGIN OBJECT CACHE
+/*
+  Persistent object cache for the JIT. Objects are stored as <CacheDir>/<key>.o,
+  where the key is a SHA1 of the module IR together with the -O level and the
+  target triple, CPU and features of the JIT's TargetMachine. The key is taken
+  before the module pipeline runs (see prepare()), so a warm start only pays for
+  parsing and IR generation, not for optimization or machine code generation.
+*/
+class DiskObjectCache : public llvm::ObjectCache {
+private:
+  // [1st] Directory holding the cached objects.
+  // [2nd] Target description mixed into every key.
+  // [3rd] Keys computed in getObject(), reused when the same module is compiled.
+
+  std::string CacheDir; // [1st]
+
+  std::string TargetID; // [2nd]
+
+  std::map<const llvm::Module *, std::string> PendingKeys; // [3rd]
+
+  std::string computeKey(const llvm::Module *M) const {
+    std::string IR;
+    llvm::raw_string_ostream OS(IR);
+    M->print(OS, nullptr);
+    OS.flush();
+
+    llvm::SHA1 Hash;
+    Hash.update(TargetID);
+    Hash.update(IR);
+    return llvm::toHex(Hash.final(), /*LowerCase=*/true);
+  }
+
+  std::string getPath(llvm::StringRef Key) const {
+    llvm::SmallString<256> Path(CacheDir);
+    llvm::sys::path::append(Path, Key + ".o");
+    return std::string(Path);
+  }
+
+public:
+  DiskObjectCache(std::string Dir, const llvm::TargetMachine &TM)
+      : CacheDir(std::move(Dir)) {
+    TargetID = ("O" + llvm::Twine(OptLevel) + "|" + TM.getTargetTriple().str() + "|" +
+                TM.getTargetCPU() + "|" + TM.getTargetFeatureString()).str();
+  }
+
+  // * Called before the module pipeline runs: fixes the key of M to its unoptimized
+  //   IR. Returns true if the object is already cached, optimization can then be skipped.
+  bool prepare(const llvm::Module *M) {
+    std::string Key = computeKey(M);
+    bool Cached = llvm::sys::fs::exists(getPath(Key));
+    PendingKeys[M] = std::move(Key);
+    return Cached;
+  }
+
+  // * Called before a module is compiled, returns the cached object if there is one.
+  std::unique_ptr<llvm::MemoryBuffer> getObject(const llvm::Module *M) override {
+    auto It = PendingKeys.find(M);
+    if (It == PendingKeys.end()) {
+      It = PendingKeys.emplace(M, computeKey(M)).first;
+    }
+    auto Obj = llvm::MemoryBuffer::getFile(getPath(It->second), /*IsText=*/false,
+                                           /*RequiresNullTerminator=*/false);
+    if (Obj) {
+      PendingKeys.erase(It);
+      return std::move(*Obj);
+    }
+    return nullptr;
+  }
+
+  // * Called after a cache miss was compiled. The object is written to a unique
+  //   temporary file and renamed into place, so concurrent runs never see a
+  //   partially written object.
+  void notifyObjectCompiled(const llvm::Module *M, llvm::MemoryBufferRef Obj) override {
+    auto It = PendingKeys.find(M);
+    std::string Key = It != PendingKeys.end() ? std::move(It->second) : computeKey(M);
+    if (It != PendingKeys.end()) {
+      PendingKeys.erase(It);
+    }
+
+    if (std::error_code EC = llvm::sys::fs::create_directories(CacheDir)) {
+      llvm::errs() << "Warning: can't create cache directory " << CacheDir << ": " << EC.message() << '\n';
+      return;
+    }
+    int FD;
+    llvm::SmallString<256> TmpPath;
+    if (llvm::sys::fs::createUniqueFile(getPath(Key) + ".tmp%%%%%%", FD, TmpPath)) {
+      return;
+    }
+    {
+      llvm::raw_fd_ostream OS(FD, /*shouldClose=*/true);
+      OS << Obj.getBuffer();
+    }
+    if (llvm::sys::fs::rename(TmpPath, getPath(Key))) {
+      llvm::sys::fs::remove(TmpPath);
+    }
+  }
+};
+
+static std::unique_ptr<DiskObjectCache> TheObjectCache;
+// END OBJECT CACHE
+
+// BEGIN OPTIMIZER
+// * The standard -O<OptLevel> module pipeline (inlining, GVN, LICM, loop and SLP
+//   vectorization, ...). The analysis managers and their registrations are made on
+//   first use and kept; the pass manager is rebuilt for every module, as some of
+//   its passes keep state from one run to the next that slows later runs down.
+struct ModulePipeline {
+  llvm::LoopAnalysisManager LAM;
+  llvm::FunctionAnalysisManager FAM;
+  llvm::CGSCCAnalysisManager CGAM;
+  llvm::ModuleAnalysisManager MAM;
+  llvm::PassInstrumentationCallbacks PIC;
+  llvm::PipelineTuningOptions PTO;
+  llvm::OptimizationLevel Level;
+
+  ModulePipeline()
+      : Level(OptLevel == 0   ? llvm::OptimizationLevel::O0
+              : OptLevel == 1 ? llvm::OptimizationLevel::O1
+              : OptLevel == 2 ? llvm::OptimizationLevel::O2
+                              : llvm::OptimizationLevel::O3) {
+    PTO.LoopVectorization = OptLevel >= 2;
+    PTO.SLPVectorization = OptLevel >= 2;
+    PTO.LoopUnrolling = OptLevel >= 1;
+
+    if (Stats.Enabled) {
+      Stats.registerCallbacks(PIC);
+    }
+    llvm::PassBuilder PB(TheTM.get(), PTO, llvm::None, &PIC);
+    PB.registerModuleAnalyses(MAM);
+    PB.registerCGSCCAnalyses(CGAM);
+    PB.registerFunctionAnalyses(FAM);
+    PB.registerLoopAnalyses(LAM);
+    PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+  }
+
+  void run(llvm::Module &M) {
+    llvm::PassBuilder PB(TheTM.get(), PTO, llvm::None, &PIC);
+    llvm::ModulePassManager MPM = OptLevel == 0 ? PB.buildO0DefaultPipeline(Level)
+                                                : PB.buildPerModuleDefaultPipeline(Level);
+    MPM.run(M, MAM);
+    // The results describe M, which is freed once it is compiled.
+    LAM.clear();
+    FAM.clear();
+    CGAM.clear();
+    MAM.clear();
+  }
+};
+
+static thread_local std::unique_ptr<ModulePipeline> ThePipeline;
+
+// * Optimizes a module about to be compiled by the JIT. The JIT compiles on the
+//   thread that looks the symbol up, so this runs with the state of that thread.
+static void OptimizeModule(llvm::Module &M) {
+  PhaseTimer T(CompileStats::Optimize);
+  Stats.IRInstructions += M.getInstructionCount();
+  if (TheObjectCache && TheObjectCache->prepare(&M)) {
+    return; // the object for this IR is cached, it won't be compiled again
+  }
+  if (!ThePipeline) {
+    ThePipeline = std::make_unique<ModulePipeline>();
+  }
+  ThePipeline->run(M);
+}
+
+static llvm::CodeGenOpt::Level getCodeGenOptLevel() {
+  switch (OptLevel) {
+    case 0: return llvm::CodeGenOpt::None;
+    case 1: return llvm::CodeGenOpt::Less;
+    case 2: return llvm::CodeGenOpt::Default;
+    default: return llvm::CodeGenOpt::Aggressive;
+  }
+}
+// END OPTIMIZER
+
+#ifdef _WIN32
+#define DLLEXPORT __declspec(dllexport)
+#else
+#define DLLEXPORT
+#endif
+
+extern "C" double printd(double);
+DLLEXPORT double printd(double x) {
+  std::cout << x << std::endl;
+  return x;
+}
+
+static auto *printd_addr = (void*)&printd;
+
+// * Array stack backing array(n) and map(). Every function that creates arrays takes
+//   a mark on entry and releases back to it on return (see FunctionAST::codegen).
+static thread_local std::vector<double *> ArrayStack;
+
+extern "C" DLLEXPORT double *bl_array_alloc(int64_t n) {
+  ArrayStack.push_back(static_cast<double *>(std::calloc(n > 0 ? n : 1, sizeof(double))));
+  return ArrayStack.back();
+}
+
+extern "C" DLLEXPORT int64_t bl_array_mark() {
+  return static_cast<int64_t>(ArrayStack.size());
+}
+
+extern "C" DLLEXPORT void bl_array_release(int64_t mark) {
+  while (static_cast<int64_t>(ArrayStack.size()) > mark) {
+    std::free(ArrayStack.back());
+    ArrayStack.pop_back();
+  }
+}
+
+// * Stateless uniform random number in [0, 1) derived from x (splitmix64 of its bits).
+//   Safe to call from any number of threads, e.g. randd(i) inside a pfor body.
+extern "C" DLLEXPORT double randd(double x) {
+  uint64_t Z;
+  std::memcpy(&Z, &x, sizeof(Z));
+  Z += 0x9E3779B97F4A7C15ULL;
+  Z = (Z ^ (Z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  Z = (Z ^ (Z >> 27)) * 0x94D049BB133111EBULL;
+  Z ^= Z >> 31;
+  return (Z >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// BEGIN MEMO RUNTIME
+/*
+  Cache behind 'memo' functions, one MemoTable per function. A table holds up to
+  MemoCapacity results in 4-way sets indexed by a hash of the argument bits; a miss
+  in a full set evicts the least recently used of its four entries. Keys compare
+  bitwise, so 0 and -0 are different keys and NaN arguments can hit. One mutex
+  guards every table: memo functions may run on pfor() worker threads.
+*/
+class MemoTable {
+private:
+  static constexpr unsigned Ways = 4;
+
+  // [1st] LastUse is a per-table tick, 0 marks an empty entry.
+  // [2nd] NumArgs keys of entry i start at Keys[i * NumArgs].
+
+  struct Entry {
+    uint64_t LastUse = 0; // [1st]
+    double Value = 0;
+  };
+
+  unsigned NumArgs;
+  size_t NumSets;
+  std::vector<Entry> Entries;
+  std::vector<double> Keys; // [2nd]
+  uint64_t Tick = 0;
+
+  size_t firstEntryOfSet(const double *Args) const {
+    uint64_t H = 0x9E3779B97F4A7C15ULL;
+    for (unsigned i = 0; i < NumArgs; ++i) {
+      uint64_t Bits;
+      std::memcpy(&Bits, &Args[i], sizeof(Bits));
+      H = (H ^ Bits) * 0xBF58476D1CE4E5B9ULL;
+      H ^= H >> 31;
+    }
+    H = (H ^ (H >> 27)) * 0x94D049BB133111EBULL; // small integers only differ in high bits
+    H ^= H >> 33;
+    return (H & (NumSets - 1)) * Ways;
+  }
+
+  bool matches(size_t I, const double *Args) const {
+    return std::memcmp(&Keys[I * NumArgs], Args, NumArgs * sizeof(double)) == 0;
+  }
+
+public:
+  const std::string Name;
+  uint64_t Hits = 0, Misses = 0, Evictions = 0;
+
+  MemoTable(llvm::StringRef Name, unsigned NumArgs, size_t Capacity)
+      : NumArgs(NumArgs), NumSets(llvm::PowerOf2Ceil(std::max<size_t>(Capacity / Ways, 1))),
+        Entries(NumSets * Ways), Keys(NumSets * Ways * NumArgs), Name(Name.str()) {}
+
+  bool lookup(const double *Args, double &Result) {
+    size_t First = firstEntryOfSet(Args);
+    for (size_t I = First; I < First + Ways; ++I) {
+      if (Entries[I].LastUse && matches(I, Args)) {
+        Entries[I].LastUse = ++Tick;
+        Result = Entries[I].Value;
+        ++Hits;
+        return true;
+      }
+    }
+    ++Misses;
+    return false;
+  }
+
+  void store(const double *Args, double Value) {
+    size_t First = firstEntryOfSet(Args);
+    size_t Victim = First;
+    for (size_t I = First; I < First + Ways; ++I) {
+      if (Entries[I].LastUse && matches(I, Args)) { // stored by a recursive call meanwhile
+        Victim = I;
+        break;
+      }
+      if (Entries[I].LastUse < Entries[Victim].LastUse) {
+        Victim = I;
+      }
+    }
+    if (Entries[Victim].LastUse && !matches(Victim, Args)) {
+      ++Evictions;
+    }
+    Entries[Victim].LastUse = ++Tick;
+    Entries[Victim].Value = Value;
+    std::copy(Args, Args + NumArgs, &Keys[Victim * NumArgs]);
+  }
+};
+
+static std::mutex MemoMutex;
+static std::vector<std::unique_ptr<MemoTable>> MemoTables;
+
+// * Returns 1 and the cached result in *out on a hit. Creates the function's table
+//   in *slot on first use.
+extern "C" DLLEXPORT int32_t bl_memo_lookup(void **slot, const char *name, int64_t nargs,
+                                            const double *args, double *out) {
+  std::lock_guard<std::mutex> L(MemoMutex);
+  if (!*slot) {
+    MemoTables.push_back(std::make_unique<MemoTable>(name, nargs, MemoCapacity));
+    *slot = MemoTables.back().get();
+  }
+  return static_cast<MemoTable *>(*slot)->lookup(args, *out);
+}
+
+extern "C" DLLEXPORT void bl_memo_store(void **slot, const double *args, double value) {
+  std::lock_guard<std::mutex> L(MemoMutex);
+  static_cast<MemoTable *>(*slot)->store(args, value);
+}
+
+// * Frees the table behind slot, once the code that uses it is gone.
+static void FreeMemoTable(void **slot) {
+  std::lock_guard<std::mutex> L(MemoMutex);
+  auto It = llvm::find_if(MemoTables, [&](const std::unique_ptr<MemoTable> &T) { return T.get() == *slot; });
+  if (It != MemoTables.end()) {
+    MemoTables.erase(It);
+  }
+  *slot = nullptr;
+}
+
+static void PrintMemoStats() {
+  std::lock_guard<std::mutex> L(MemoMutex);
+  for (const auto &T : MemoTables) {
+    llvm::errs() << "memo " << T->Name << ": " << T->Hits << " hits, " << T->Misses
+                 << " misses, " << T->Evictions << " evictions\n";
+  }
+}
+// END MEMO RUNTIME
+
+// BEGIN PARALLEL RUNTIME
+/*
+  Work-stealing thread pool behind pfor(). A job is split into grain-sized chunks;
+  a task is a range of chunk indices. Whoever runs a task keeps halving it, pushing
+  the upper half onto the bottom of its own deque, until one chunk is left to run.
+  Idle workers steal from the top of other deques, i.e. the largest ranges. The
+  thread that called pfor() works on the pool too until its job is done, so nested
+  pfor() calls never deadlock.
+*/
+class WorkStealingPool {
+public:
+  using ChunkFn = double (*)(double, double);
+
+  static constexpr double DefaultChunks = 256; // enough for 32 threads at 8 each
+
+private:
+  struct Job {
+    ChunkFn Fn;
+    double Lo, Hi, Grain;
+    std::vector<double> Results; // one partial sum per chunk
+    std::atomic<int64_t> Remaining;
+  };
+
+  struct Task {
+    Job *J;
+    int64_t Begin, End; // chunk indices [Begin, End)
+  };
+
+  struct Worker {
+    std::mutex M;
+    std::deque<Task> Tasks;
+  };
+
+  // [1st] One deque per pool thread; slot 0 belongs to threads outside the pool.
+  // [2nd] Idle pool threads sleep until something is queued.
+
+  std::vector<std::unique_ptr<Worker>> Workers; // [1st]
+  std::vector<std::thread> Threads;
+  static thread_local unsigned Self;
+
+  std::mutex SleepM; // [2nd]
+  std::condition_variable WakeUp;
+  std::atomic<int64_t> Queued{0};
+  bool ShuttingDown = false;
+
+  void push(Task T) {
+    Queued.fetch_add(1);
+    {
+      std::lock_guard<std::mutex> L(Workers[Self]->M);
+      Workers[Self]->Tasks.push_back(T);
+    }
+    { std::lock_guard<std::mutex> L(SleepM); }
+    WakeUp.notify_one();
+  }
+
+  bool findTask(Task &T) {
+    // Own deque from the bottom first, then steal from the top of the others.
+    for (size_t i = 0; i < Workers.size(); ++i) {
+      Worker &W = *Workers[(Self + i) % Workers.size()];
+      std::lock_guard<std::mutex> L(W.M);
+      if (W.Tasks.empty()) {
+        continue;
+      }
+      if (i == 0) {
+        T = W.Tasks.back();
+        W.Tasks.pop_back();
+      } else {
+        T = W.Tasks.front();
+        W.Tasks.pop_front();
+      }
+      Queued.fetch_sub(1);
+      return true;
+    }
+    return false;
+  }
+
+  void run(Task T) {
+    while (T.End - T.Begin > 1) {
+      int64_t Mid = T.Begin + (T.End - T.Begin) / 2;
+      push({T.J, Mid, T.End});
+      T.End = Mid;
+    }
+    Job &J = *T.J;
+    double A = J.Lo + T.Begin * J.Grain;
+    J.Results[T.Begin] = J.Fn(A, std::min(J.Hi, A + J.Grain));
+    J.Remaining.fetch_sub(1, std::memory_order_acq_rel);
+  }
+
+  void workerLoop(unsigned Index) {
+    Self = Index;
+    while (true) {
+      Task T;
+      if (findTask(T)) {
+        run(T);
+        continue;
+      }
+      std::unique_lock<std::mutex> L(SleepM);
+      WakeUp.wait(L, [this] { return ShuttingDown || Queued.load() > 0; });
+      if (ShuttingDown) {
+        return;
+      }
+    }
+  }
+
+public:
+  WorkStealingPool(unsigned NumThreads) {
+    for (unsigned i = 0; i < std::max(NumThreads, 1u); ++i) {
+      Workers.push_back(std::make_unique<Worker>());
+    }
+    for (unsigned i = 1; i < Workers.size(); ++i) {
+      Threads.emplace_back(&WorkStealingPool::workerLoop, this, i);
+    }
+  }
+
+  ~WorkStealingPool() {
+    {
+      std::lock_guard<std::mutex> L(SleepM);
+      ShuttingDown = true;
+    }
+    WakeUp.notify_all();
+    for (auto &T : Threads) {
+      T.join();
+    }
+  }
+
+  // * Runs Fn over [Lo, Hi) in chunks of Grain iterations and returns the sum of
+  //   the chunk results. Grain < 1 splits the range into DefaultChunks chunks; it
+  //   mustn't depend on the pool size, chunk boundaries set the summation order.
+  double parallelFor(ChunkFn Fn, double Lo, double Hi, double Grain) {
+    if (!(Hi > Lo)) {
+      return 0;
+    }
+    double Iterations = std::ceil(Hi - Lo);
+    Grain = Grain >= 1 ? std::ceil(Grain)
+                       : std::max(1.0, std::ceil(Iterations / DefaultChunks));
+
+    Job J;
+    J.Fn = Fn;
+    J.Lo = Lo;
+    J.Hi = Hi;
+    J.Grain = Grain;
+    int64_t Chunks = static_cast<int64_t>(std::ceil(Iterations / Grain));
+    J.Results.assign(Chunks, 0.0);
+    J.Remaining = Chunks;
+
+    push({&J, 0, Chunks});
+    while (J.Remaining.load(std::memory_order_acquire) > 0) {
+      Task T;
+      if (findTask(T)) {
+        run(T);
+      } else {
+        std::this_thread::yield();
+      }
+    }
+
+    double Sum = 0;
+    for (double R : J.Results) {
+      Sum += R;
+    }
+    return Sum;
+  }
+};
+
+thread_local unsigned WorkStealingPool::Self = 0;
+
+extern "C" DLLEXPORT double bl_pfor(double lo, double hi, double grain,
+                                    WorkStealingPool::ChunkFn chunk) {
+  // Started on first use, scripts without pfor() never spawn threads.
+  static WorkStealingPool Pool(PforThreads ? PforThreads : std::thread::hardware_concurrency());
+  return Pool.parallelFor(chunk, lo, hi, grain);
+}
+// END PARALLEL RUNTIME
+
+
+// * Parse throughput benchmark: parses the whole input and reports nodes/sec.
+//   --heap-ast allocates every node separately, which is how the AST used to be built.
+static int RunParseBenchmark(parser &p, bool HeapAST) {
+  p.getArena().setUseHeap(HeapAST);
+
+  auto Start = std::chrono::steady_clock::now();
+  p.getNextToken();
+  size_t Nodes = p.BenchParse();
+  std::chrono::duration<double> Elapsed = std::chrono::steady_clock::now() - Start;
+
+  llvm::outs() << "allocator: " << (HeapAST ? "heap" : "arena") << "\n"
+               << "nodes:     " << Nodes << "\n"
+               << "seconds:   " << Elapsed.count() << "\n"
+               << "nodes/sec: " << (Elapsed.count() > 0 ? Nodes / Elapsed.count() : 0.0) << "\n";
+  return 0;
+}
+
+// BEGIN STAGE BENCHMARKS
+/*
+  `basic-lang bench` (or the basic-lang-bench build target) times each stage of the
+  compiler on a generated program and prints the results as JSON, so they can be
+  tracked from release to release:
+
+    lexer    lexer::gettok over the whole program           tokens/sec
+    parser   parser::ParseDefinition / ParseExpression       nodes/sec
+    codegen  FunctionAST::codegen, IR and per-function passes functions/sec
+    jit      LLJIT::addIRModule + lookup of a one-function module, per module latency
+
+  The program has --functions=N definitions 'fn fK(a b c) <expr>' whose expression
+  trees are --depth=D levels deep, built from the operators, if, for loops and
+  calls of earlier functions. Generation is deterministic for a given --seed.
+  Throughput stages run --repeat=R times and report the fastest run.
+*/
+struct StageBenchOptions {
+  unsigned Functions = 2000;
+  unsigned Depth = 6;
+  unsigned JitModules = 200;
+  unsigned Repeat = 5;
+  unsigned Seed = 1;
+  unsigned Rows = 1 << 20;
+};
+
+class ProgramGenerator {
+private:
+  std::mt19937 Rng;
+  std::string Out;
+
+  unsigned pick(unsigned N) { return std::uniform_int_distribution<unsigned>(0, N - 1)(Rng); }
+
+  void leaf() {
+    if (pick(3)) {
+      Out += "abc"[pick(3)];
+    } else {
+      Out += std::to_string(pick(100)) + "." + std::to_string(pick(10));
+    }
+  }
+
+  // Expression of at most Depth levels, may call f0 .. f<Callable-1>.
+  void expr(unsigned Depth, unsigned Callable) {
+    if (Depth == 0 || pick(8) == 0) {
+      leaf();
+      return;
+    }
+    unsigned Kind = pick(16);
+    if (Kind < 11) {
+      Out += '(';
+      expr(Depth - 1, Callable);
+      Out += " +-*<"[1 + pick(4)];
+      expr(Depth - 1, Callable);
+      Out += ')';
+    } else if (Kind < 13) {
+      Out += "(if ";
+      expr(Depth - 1, Callable);
+      Out += " then ";
+      expr(Depth - 1, Callable);
+      Out += " else ";
+      expr(Depth - 1, Callable);
+      Out += ')';
+    } else if (Kind < 14) {
+      Out += "(s = 0 : (for i = 0, " + std::to_string(1 + pick(16)) + " in s = s + ";
+      expr(Depth - 1, Callable);
+      Out += ") : s)";
+    } else if (Callable) {
+      Out += "f" + std::to_string(pick(Callable)) + "(";
+      for (unsigned i = 0; i < 3; ++i) {
+        Out += i ? ", " : "";
+        expr(Depth - 1, Callable);
+      }
+      Out += ')';
+    } else {
+      leaf();
+    }
+  }
+
+public:
+  ProgramGenerator(unsigned Seed) : Rng(Seed) {}
+
+  // * One definition named Name; its body calls only f0 .. f<Callable-1>.
+  std::string function(llvm::StringRef Name, unsigned Depth, unsigned Callable) {
+    Out = ("fn " + Name + "(a b c) ").str();
+    expr(Depth, Callable);
+    Out += ";\n";
+    return std::move(Out);
+  }
+
+  std::string program(unsigned Functions, unsigned Depth) {
+    std::string Program;
+    for (unsigned i = 0; i < Functions; ++i) {
+      Program += function("f" + std::to_string(i), Depth, i);
+    }
+    return Program;
+  }
+};
+
+static int RunStageBenchmarks(const StageBenchOptions &Opts) {
+  using Seconds = std::chrono::duration<double>;
+  ProgramGenerator Gen(Opts.Seed);
+  const std::string Program = Gen.program(Opts.Functions, Opts.Depth);
+  const unsigned Repeat = std::max(Opts.Repeat, 1u);
+
+  uint64_t Tokens = 0, Nodes = 0, Functions = 0;
+  double LexSecs = HUGE_VAL, ParseSecs = HUGE_VAL, CodegenSecs = HUGE_VAL;
+  for (unsigned r = 0; r < Repeat; ++r) {
+    {
+      lexer L(MemorySource::fromString(Program));
+      Tokens = 0;
+      auto Start = std::chrono::steady_clock::now();
+      while (L.gettok() != tok_eof) {
+        ++Tokens;
+      }
+      LexSecs = std::min(LexSecs, Seconds(std::chrono::steady_clock::now() - Start).count());
+    }
+    {
+      lexer L(MemorySource::fromString(Program));
+      parser P(L);
+      auto Start = std::chrono::steady_clock::now();
+      P.getNextToken();
+      Nodes = P.BenchParse();
+      ParseSecs = std::min(ParseSecs, Seconds(std::chrono::steady_clock::now() - Start).count());
+    }
+    {
+      lexer L(MemorySource::fromString(Program));
+      parser P(L);
+      P.InitializeModuleAndPassManager(); // every repetition defines f0.. anew
+      Seconds Elapsed(0);
+      Functions = P.BenchCodegen(Elapsed);
+      CodegenSecs = std::min(CodegenSecs, Elapsed.count());
+    }
+  }
+
+  // One single-function module at a time, as the REPL hands them to the JIT.
+  std::vector<double> Latencies;
+  for (unsigned i = 0; i < Opts.JitModules; ++i) {
+    std::string Name = "benchjit" + std::to_string(i);
+    lexer L(MemorySource::fromString(Gen.function(Name, Opts.Depth, 0)));
+    parser P(L);
+    P.InitializeModuleAndPassManager();
+    P.getNextToken();
+    auto fnAST = P.ParseDefinition();
+    if (!fnAST || !fnAST->codegen()) {
+      return 1;
+    }
+    auto Start = std::chrono::steady_clock::now();
+    ExitOnErr(AddModuleToJIT());
+    ExitOnErr(LookupInJIT(Name));
+    Latencies.push_back(Seconds(std::chrono::steady_clock::now() - Start).count() * 1e6);
+  }
+
+  // One formula over Opts.Rows rows: called once per row through its pointer, and
+  // once for all rows through its batch loop (see BATCH EVALUATION).
+  double RowSecs = HUGE_VAL, BatchSecs = HUGE_VAL;
+  bool BatchMatches = true;
+  {
+    lexer L(MemorySource::fromString("fn batchrow(a b c) (a*b + c)*0.5 + (a < b)*c - a*a*0.25;"));
+    parser P(L);
+    P.InitializeModuleAndPassManager();
+    P.getNextToken();
+    auto fnAST = P.ParseDefinition();
+    if (fnAST && L.getCurTok() != ';') {
+      llvm::errs() << "Error: the batch formula wasn't parsed to its end\n";
+      return 1;
+    }
+    llvm::Function *F = fnAST ? fnAST->codegen() : nullptr;
+    if (!F) {
+      return 1;
+    }
+    EmitBatchFunction(F);
+    ExitOnErr(AddModuleToJIT());
+    auto *Row = reinterpret_cast<double (*)(double, double, double)>(
+        static_cast<uintptr_t>(ExitOnErr(LookupInJIT("batchrow"))));
+    auto *Batch = reinterpret_cast<void (*)(const double *const *, double *, int64_t)>(
+        static_cast<uintptr_t>(ExitOnErr(LookupInJIT("batchrow.batch"))));
+
+    std::mt19937 Rng(Opts.Seed);
+    std::uniform_real_distribution<double> Dist(0.0, 1.0);
+    std::vector<double> A(Opts.Rows), B(Opts.Rows), C(Opts.Rows), RowOut(Opts.Rows), BatchOut(Opts.Rows);
+    for (unsigned k = 0; k < Opts.Rows; ++k) {
+      A[k] = Dist(Rng), B[k] = Dist(Rng), C[k] = Dist(Rng);
+    }
+    const double *Columns[] = {A.data(), B.data(), C.data()};
+    for (unsigned r = 0; r < Repeat; ++r) {
+      auto Start = std::chrono::steady_clock::now();
+      for (unsigned k = 0; k < Opts.Rows; ++k) {
+        RowOut[k] = Row(A[k], B[k], C[k]);
+      }
+      RowSecs = std::min(RowSecs, Seconds(std::chrono::steady_clock::now() - Start).count());
+      Start = std::chrono::steady_clock::now();
+      Batch(Columns, BatchOut.data(), Opts.Rows);
+      BatchSecs = std::min(BatchSecs, Seconds(std::chrono::steady_clock::now() - Start).count());
+    }
+    BatchMatches = RowOut == BatchOut;
+  }
+  std::sort(Latencies.begin(), Latencies.end());
+  auto Percentile = [&](double P) {
+    return Latencies.empty() ? 0.0 : Latencies[std::min<size_t>(Latencies.size() - 1, P * Latencies.size())];
+  };
+  double Mean = 0;
+  for (double L : Latencies) {
+    Mean += L / Latencies.size();
+  }
+
+  auto PerSec = [](double Count, double Secs) { return Secs > 0 ? Count / Secs : 0.0; };
+  llvm::json::OStream J(llvm::outs(), /*IndentSize=*/2);
+  J.object([&] {
+    J.attributeObject("input", [&] {
+      J.attribute("functions", Opts.Functions);
+      J.attribute("depth", Opts.Depth);
+      J.attribute("seed", Opts.Seed);
+      J.attribute("bytes", static_cast<int64_t>(Program.size()));
+    });
+    J.attribute("opt_level", OptLevel);
+    J.attribute("repeat", Repeat);
+    J.attributeObject("lexer", [&] {
+      J.attribute("tokens", static_cast<int64_t>(Tokens));
+      J.attribute("seconds", LexSecs);
+      J.attribute("tokens_per_sec", PerSec(Tokens, LexSecs));
+    });
+    J.attributeObject("parser", [&] {
+      J.attribute("nodes", static_cast<int64_t>(Nodes));
+      J.attribute("seconds", ParseSecs);
+      J.attribute("nodes_per_sec", PerSec(Nodes, ParseSecs));
+    });
+    J.attributeObject("codegen", [&] {
+      J.attribute("functions", static_cast<int64_t>(Functions));
+      J.attribute("seconds", CodegenSecs);
+      J.attribute("functions_per_sec", PerSec(Functions, CodegenSecs));
+    });
+    J.attributeObject("jit", [&] {
+      J.attribute("modules", static_cast<int64_t>(Latencies.size()));
+      J.attribute("mean_us", Mean);
+      J.attribute("p50_us", Percentile(0.5));
+      J.attribute("p90_us", Percentile(0.9));
+      J.attribute("max_us", Latencies.empty() ? 0.0 : Latencies.back());
+    });
+    J.attributeObject("batch", [&] {
+      J.attribute("rows", Opts.Rows);
+      J.attribute("per_row_rows_per_sec", PerSec(Opts.Rows, RowSecs));
+      J.attribute("batch_rows_per_sec", PerSec(Opts.Rows, BatchSecs));
+      J.attribute("speedup", BatchSecs > 0 ? RowSecs / BatchSecs : 0.0);
+      J.attribute("results_match", BatchMatches);
+    });
+  });
+  llvm::outs() << '\n';
+  return Functions == Opts.Functions && BatchMatches ? 0 : 1;
+}
+// END STAGE BENCHMARKS
+
+// BEGIN JIT SETUP
+// * Generates code for the host CPU and all of its features (AVX2, AVX-512, ...) unless
+//   told otherwise. CPU alone drops the detected features and uses the named CPU's
+//   defaults, so output doesn't depend on the build host.
+static llvm::Expected<llvm::orc::JITTargetMachineBuilder>
+getJITTargetMachineBuilder(const char *CPU, const char *Features) {
+  auto JTMB = llvm::orc::JITTargetMachineBuilder::detectHost();
+  if (!JTMB) {
+    return JTMB.takeError();
+  }
+  if (CPU) {
+    JTMB->setCPU(CPU);
+    JTMB->setFeatures("");
+  }
+  if (Features) {
+    JTMB->setFeatures(Features);
+  }
+  JTMB->setCodeGenOptLevel(getCodeGenOptLevel());
+  if (GlobalFMF.allowContract()) {
+    JTMB->getOptions().AllowFPOpFusion = llvm::FPOpFusion::Fast;
+  }
+  return JTMB;
+}
+
+// * Creates TheJIT, with the runtime functions defined in it, and TheTM for JTMB.
+//   With a CacheDir, compiled objects are kept on disk (see OBJECT CACHE).
+static llvm::Error InitializeJIT(llvm::orc::JITTargetMachineBuilder JTMB, const std::string &CacheDir) {
+  auto TM = JTMB.createTargetMachine();
+  if (!TM) {
+    return TM.takeError();
+  }
+  TheTM = std::move(*TM);
+
+  llvm::orc::LLJITBuilder JITBuilder;
+  JITBuilder.setJITTargetMachineBuilder(JTMB);
+  if (!CacheDir.empty()) {
+    // Compile through a SimpleCompiler that consults the on-disk object cache.
+    JITBuilder.setCompileFunctionCreator(
+        [CacheDir](llvm::orc::JITTargetMachineBuilder JTMB)
+            -> llvm::Expected<std::unique_ptr<llvm::orc::IRCompileLayer::IRCompiler>> {
+          auto TM = JTMB.createTargetMachine();
+          if (!TM) {
+            return TM.takeError();
+          }
+          TheObjectCache = std::make_unique<DiskObjectCache>(CacheDir, **TM);
+          return std::make_unique<llvm::orc::TMOwningSimpleCompiler>(std::move(*TM),
+                                                                    TheObjectCache.get());
+        });
+  }
+  auto JIT = JITBuilder.create();
+  if (!JIT) {
+    return JIT.takeError();
+  }
+  TheJIT = std::move(*JIT);
+
+  // Every module goes through the -O pipeline right before it is compiled.
+  TheJIT->getIRTransformLayer().setTransform(
+      [](llvm::orc::ThreadSafeModule TSM, llvm::orc::MaterializationResponsibility &)
+          -> llvm::Expected<llvm::orc::ThreadSafeModule> {
+        TSM.withModuleDo([](llvm::Module &M) { OptimizeModule(M); });
+        return std::move(TSM);
+      });
+
+  // Register host process symbols for JIT (LLVM 10 way)
+  llvm::sys::DynamicLibrary::LoadLibraryPermanently(nullptr);
+  auto Generator = llvm::orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(
+      TheJIT->getDataLayout().getGlobalPrefix());
+  if (!Generator) {
+    return Generator.takeError();
+  }
+  TheJIT->getMainJITDylib().addGenerator(std::move(*Generator));
+
+  // The runtime functions are defined explicitly, the executable doesn't have to
+  // export its symbols for scripts to 'incl' them.
+  return TheJIT->getMainJITDylib().define(llvm::orc::absoluteSymbols({
+      {TheJIT->mangleAndIntern("printd"),
+       llvm::JITEvaluatedSymbol::fromPointer(printd_addr)},
+      {TheJIT->mangleAndIntern("bl_array_alloc"),
+       llvm::JITEvaluatedSymbol::fromPointer(&bl_array_alloc)},
+      {TheJIT->mangleAndIntern("bl_array_mark"),
+       llvm::JITEvaluatedSymbol::fromPointer(&bl_array_mark)},
+      {TheJIT->mangleAndIntern("bl_array_release"),
+       llvm::JITEvaluatedSymbol::fromPointer(&bl_array_release)},
+      {TheJIT->mangleAndIntern("bl_pfor"),
+       llvm::JITEvaluatedSymbol::fromPointer(&bl_pfor)},
+      {TheJIT->mangleAndIntern("randd"),
+       llvm::JITEvaluatedSymbol::fromPointer(&randd)},
+      {TheJIT->mangleAndIntern("bl_memo_lookup"),
+       llvm::JITEvaluatedSymbol::fromPointer(&bl_memo_lookup)},
+      {TheJIT->mangleAndIntern("bl_memo_store"),
+       llvm::JITEvaluatedSymbol::fromPointer(&bl_memo_store)},
+  }));
+}
+// END JIT SETUP
+
+// BEGIN AHEAD-OF-TIME BUILD
+/*
+  `basic-lang build file.bl -o out.o|out.so` runs the same codegen and -O pipeline
+  as `run`, then emits the module through TheTM instead of handing it to the JIT.
+  Every 'fn' is exported under its own name with the C signature described in the
+  README and declared in a header next to the output (out.h). Shared libraries are
+  linked by the system's C compiler driver.
+
+  Functions that use arrays, memo, pfor, randd or printd call the runtime the
+  executable defines for the JIT. Programs linking the output get it from
+  libbasiclang; the header lists the runtime functions the output calls.
+*/
+static const char *const RuntimeFunctions[] = {
+    "printd", "randd", "bl_array_alloc", "bl_array_mark", "bl_array_release",
+    "bl_pfor", "bl_memo_lookup", "bl_memo_store",
+};
+
+// * Creates TheTM for JTMB, generating position independent code so the output can
+//   go into shared libraries and PIE executables.
+static llvm::Error InitializeAOTTarget(llvm::orc::JITTargetMachineBuilder JTMB) {
+  JTMB.setRelocationModel(llvm::Reloc::PIC_);
+  auto TM = JTMB.createTargetMachine();
+  if (!TM) {
+    return TM.takeError();
+  }
+  TheTM = std::move(*TM);
+  return llvm::Error::success();
+}
+
+static llvm::Error WriteObjectFile(llvm::Module &M, llvm::StringRef Path) {
+  PhaseTimer T(CompileStats::JIT);
+  std::error_code EC;
+  llvm::raw_fd_ostream OS(Path, EC, llvm::sys::fs::OF_None);
+  if (EC) {
+    return llvm::createFileError(Path, EC);
+  }
+  llvm::legacy::PassManager PM;
+  if (TheTM->addPassesToEmitFile(PM, OS, nullptr, llvm::CGFT_ObjectFile)) {
+    return llvm::createStringError(llvm::inconvertibleErrorCode(),
+                                   "the target can't emit object files");
+  }
+  PM.run(M);
+  OS.flush();
+  if (OS.has_error()) {
+    EC = OS.error();
+    OS.clear_error();
+    return llvm::createFileError(Path, EC);
+  }
+  return llvm::Error::success();
+}
+
+// * Links the object file Obj into the shared library Path with `cc -shared`.
+static llvm::Error LinkSharedLibrary(llvm::StringRef Obj, llvm::StringRef Path) {
+  PhaseTimer T(CompileStats::JIT);
+  auto CC = llvm::sys::findProgramByName("cc");
+  if (!CC) {
+    return llvm::createStringError(CC.getError(), "can't find cc to link " + Path);
+  }
+  llvm::StringRef Args[] = {*CC, "-shared", "-o", Path, Obj, "-lm"};
+  std::string ErrMsg;
+  if (llvm::sys::ExecuteAndWait(*CC, Args, llvm::None, {}, 0, 0, &ErrMsg) != 0) {
+    return llvm::createStringError(llvm::inconvertibleErrorCode(),
+                                   "linking " + Path + " failed" + (ErrMsg.empty() ? "" : ": " + ErrMsg));
+  }
+  return llvm::Error::success();
+}
+
+// * Writes the C header declaring the functions in Defined, operators excepted.
+static llvm::Error WriteHeader(llvm::StringRef Path, llvm::StringRef InputName,
+                               llvm::ArrayRef<std::unique_ptr<PrototypeAST>> Defined,
+                               llvm::ArrayRef<llvm::StringRef> Runtime) {
+  std::error_code EC;
+  llvm::raw_fd_ostream OS(Path, EC, llvm::sys::fs::OF_Text);
+  if (EC) {
+    return llvm::createFileError(Path, EC);
+  }
+  std::string Guard;
+  for (char C : llvm::sys::path::filename(Path)) {
+    Guard += llvm::isAlnum(C) ? llvm::toUpper(C) : '_';
+  }
+
+  OS << "/* Generated by basic-lang build from " << llvm::sys::path::filename(InputName) << ". */\n"
+     << "#ifndef " << Guard << "\n#define " << Guard << "\n\n"
+     << "#include <stdint.h>\n\n"
+     << "#ifdef __cplusplus\nextern \"C\" {\n#endif\n\n"
+     << "#ifndef BL_ARRAY_DEFINED\n#define BL_ARRAY_DEFINED\n"
+     << "/* An array argument, passed by value. */\n"
+     << "typedef struct {\n  double *data;\n  int64_t len;\n} bl_array;\n#endif\n\n";
+  if (!Runtime.empty()) {
+    OS << "/* Calls the basic-lang runtime (link libbasiclang): " << llvm::join(Runtime, ", ")
+       << ". */\n\n";
+  }
+  for (const auto &Proto : Defined) {
+    if (Proto->isBinaryOp()) {
+      continue; // not a C identifier, and inlined at every use anyway
+    }
+    OS << "double " << Proto->getName() << '(';
+    llvm::ArrayRef<Symbol> Args = Proto->getArgs();
+    for (unsigned i = 0; i < Args.size(); ++i) {
+      OS << (i ? ", " : "") << (Proto->isArrayArg(i) ? "bl_array " : "double ")
+         << Symbols.getName(Args[i]);
+    }
+    OS << (Args.empty() ? "void" : "") << ");\n";
+  }
+  OS << "\n#ifdef __cplusplus\n}\n#endif\n\n#endif /* " << Guard << " */\n";
+
+  OS.flush();
+  if (OS.has_error()) {
+    EC = OS.error();
+    OS.clear_error();
+    return llvm::createFileError(Path, EC);
+  }
+  return llvm::Error::success();
+}
+
+// * Driver for `basic-lang build`: compiles the definitions of the input into Output,
+//   an object file (.o) or shared library (.so), and writes their header next to it.
+//   Returns the process exit code.
+static int RunBuild(parser &P, llvm::StringRef InputName, llvm::StringRef Output) {
+  llvm::StringRef Ext = llvm::sys::path::extension(Output);
+  if (Ext != ".o" && Ext != ".so") {
+    llvm::errs() << "Error: build output must be an object file (.o) or shared library (.so)\n";
+    return 1;
+  }
+  std::vector<parser::TopLevelExpr> Exprs;
+  std::vector<std::unique_ptr<PrototypeAST>> Defined;
+  if (!P.CodegenItems(Exprs, Defined)) {
+    return 1;
+  }
+  if (!Exprs.empty()) {
+    llvm::errs() << "Error: build takes definitions only, a library has no top-level code to run\n";
+    return 1;
+  }
+  // Only what the header declares is exported; operators, vector variants and
+  // memo slots are hidden.
+  for (llvm::GlobalValue &GV : TheModule->global_values()) {
+    if (!GV.isDeclaration() && GV.hasExternalLinkage() &&
+        llvm::none_of(Defined, [&](const std::unique_ptr<PrototypeAST> &Proto) {
+          return !Proto->isBinaryOp() && Proto->getName() == GV.getName();
+        })) {
+      GV.setVisibility(llvm::GlobalValue::HiddenVisibility);
+    }
+  }
+  OptimizeModule(*TheModule);
+
+  std::vector<llvm::StringRef> Runtime;
+  for (const char *Name : RuntimeFunctions) {
+    llvm::Function *F = TheModule->getFunction(Name);
+    if (F && !F->use_empty()) {
+      Runtime.push_back(Name);
+    }
+  }
+
+  // A shared library is linked from a temporary object file.
+  llvm::SmallString<128> Obj(Output);
+  llvm::FileRemover RemoveObj;
+  if (Ext == ".so") {
+    if (std::error_code EC = llvm::sys::fs::createTemporaryFile("basic-lang", "o", Obj)) {
+      llvm::errs() << "Error: can't create a temporary object file: " << EC.message() << '\n';
+      return 1;
+    }
+    RemoveObj.setFile(Obj);
+  }
+  llvm::Error Err = WriteObjectFile(*TheModule, Obj);
+  if (!Err && Ext == ".so") {
+    Err = LinkSharedLibrary(Obj, Output);
+  }
+  if (!Err) {
+    llvm::SmallString<128> Header(Output);
+    llvm::sys::path::replace_extension(Header, "h");
+    Err = WriteHeader(Header, InputName, Defined, Runtime);
+  }
+  if (Err) {
+    llvm::errs() << "Error: " << llvm::toString(std::move(Err)) << '\n';
+    return 1;
+  }
+  return 0;
+}
+// END AHEAD-OF-TIME BUILD
 
-     return ParseBinOpRHS(0, std::move(LHS));
-   }
+// BEGIN LIBRARY API
+/*
+  basiclang::Compiler, see basiclang.h. The compiler works on the thread_local
+  globals of LLVM CONTEXT. A Compiler keeps a set of its own in a CompilerState and
+  swaps it with the calling thread's for the duration of each call (StateScope),
+  so none of the code generator needs to know which compiler it works for.
+*/
+namespace basiclang {
 
-   std::unique_ptr<ExprAST> ParseNumberExpr() {
-     auto Result = std::make_unique<NumberExprAST>(m_lexer.getNumVal());
-     getNextToken(); // consume the number
-     return std::move(Result);
-   } 
-   
-   std::unique_ptr<ExprAST> ParseParenExpr() {
-     getNextToken(); // eat (.
-     auto V = ParseExpression();
-     
-     if (!V) {
-       return nullptr;
-     }
+struct CompilerState {
+  // [1st] Swapped with the thread_local globals of the same name, see swap().
+  // [2nd] Errors of the current call; ErrorStream points here while swapped in.
+  // [3rd] Why the JIT couldn't be created, if it couldn't.
+  // [4th] Memo slots of the modules compile() added, their tables are freed with
+  //       the compiler.
 
-     if (m_lexer.getCurTok() != ')') {
-       return LogError<ExprAST>("expected ')'");
-     }
-     
-     getNextToken(); // eat ).
-     return V;
-   }
-  std::unique_ptr<ExprAST> ParseAssignmentExpr(std::unique_ptr<ExprAST> LHS, parser &p) {
-    auto *Var = dynamic_cast<VariableExprAST*>(LHS.get());
-    if (!Var)
-      return nullptr;
-    p.getNextToken(); // eat '='
-    auto RHS = p.ParseExpression();
-    if (!RHS)
-      return nullptr;
-    return std::make_unique<AssignExprAST>(Var->getName(), std::move(RHS));
-  }
-   std::unique_ptr<ExprAST> ParseIdentifierExpr() {
-     std::string IdName = m_lexer.getIdentifierStr();
+  SymbolTable Symbols; // [1st]
+  PrecedenceTable BinopPrecedence = BuiltinPrecedence;
+  Symbol BinopFunctions[256] = {};
+  llvm::orc::ThreadSafeContext TheTSC;
+  llvm::LLVMContext *TheContext = nullptr;
+  unsigned ModulesInContext = 0;
+  std::unique_ptr<llvm::orc::LLJIT> TheJIT;
+  std::unique_ptr<llvm::TargetMachine> TheTM;
+  std::unique_ptr<ModulePipeline> ThePipeline;
+  std::unique_ptr<llvm::PassInstrumentationCallbacks> ThePIC;
+  std::unique_ptr<llvm::StandardInstrumentations> TheSI;
+  std::unique_ptr<llvm::FunctionPassManager> TheFPM;
+  std::unique_ptr<llvm::LoopAnalysisManager> TheLAM;
+  std::unique_ptr<llvm::FunctionAnalysisManager> TheFAM;
+  std::unique_ptr<llvm::CGSCCAnalysisManager> TheCGAM;
+  std::unique_ptr<llvm::ModuleAnalysisManager> TheMAM;
+  std::unique_ptr<llvm::Module> TheModule;
+  std::unique_ptr<llvm::IRBuilder<>> Builder;
+  SymbolMap<std::unique_ptr<PrototypeAST>> FunctionProtos;
+  SymbolMap<std::unique_ptr<PrototypeAST>> DefinedProtos;
+  ScopeTable NamedValues;
+  unsigned OptLevel = 2;
+  llvm::FastMathFlags GlobalFMF;
 
-     getNextToken(); // eat identifier.
+  std::string Errors; // [2nd]
+  llvm::raw_string_ostream ErrorOS{Errors};
+  llvm::raw_ostream *ErrorStream = &ErrorOS;
 
-     if (m_lexer.getCurTok() != '(') { // Simple variable ref.
-       return std::make_unique<VariableExprAST> (IdName);
-     }
+  std::string JITError; // [3rd]
 
-     // Call.
-     getNextToken(); // eat (
-     std::vector<std::unique_ptr<ExprAST>> Args;
-     
-     if(m_lexer.getCurTok() != ')') {
-       while (true) {
-         if (auto Arg = ParseExpression()) {
-           Args.push_back(std::move(Arg));
-         } else {
-           return nullptr;
-         }
-         if (m_lexer.getCurTok() == ')') {
-           break;
-         }
-         if (m_lexer.getCurTok() != ',') {
-           return LogError<ExprAST>("Expected ')' or ',' in argument list");
-         }
-         getNextToken();
-       }
-     }
-     getNextToken(); // Eat the ')'.
+  std::vector<std::string> MemoSlots; // [4th]
 
-     return std::make_unique<CallExprAST> (IdName, std::move(Args));
-   }
-   std::unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec, std::unique_ptr<ExprAST> LHS) {
-     while (true) {
-       int TokPrec = getTokPrecedence();
+  void swap() {
+    std::swap(Symbols, ::Symbols);
+    std::swap(BinopPrecedence, ::BinopPrecedence);
+    std::swap(BinopFunctions, ::BinopFunctions);
+    std::swap(TheTSC, ::TheTSC);
+    std::swap(TheContext, ::TheContext);
+    std::swap(ModulesInContext, ::ModulesInContext);
+    std::swap(TheJIT, ::TheJIT);
+    std::swap(TheTM, ::TheTM);
+    std::swap(ThePipeline, ::ThePipeline);
+    std::swap(ThePIC, ::ThePIC);
+    std::swap(TheSI, ::TheSI);
+    std::swap(TheFPM, ::TheFPM);
+    std::swap(TheLAM, ::TheLAM);
+    std::swap(TheFAM, ::TheFAM);
+    std::swap(TheCGAM, ::TheCGAM);
+    std::swap(TheMAM, ::TheMAM);
+    std::swap(TheModule, ::TheModule);
+    std::swap(Builder, ::Builder);
+    std::swap(FunctionProtos, ::FunctionProtos);
+    std::swap(DefinedProtos, ::DefinedProtos);
+    std::swap(NamedValues, ::NamedValues);
+    std::swap(OptLevel, ::OptLevel);
+    std::swap(GlobalFMF, ::GlobalFMF);
+    std::swap(ErrorStream, ::ErrorStream);
+  }
+};
 
-       if (TokPrec < ExprPrec) {
-         return LHS;
-       }
+// * Makes S the state of the calling thread until the end of the scope.
+class StateScope {
+private:
+  CompilerState &S;
 
-       int BinOp = m_lexer.getCurTok();
-       getNextToken(); // eat binop
+public:
+  explicit StateScope(CompilerState &S) : S(S) { S.swap(); }
+  ~StateScope() { S.swap(); }
+};
 
-       auto RHS = ParsePrimary();
-       if (!RHS) {
-         return nullptr;
-       }
+static bool hasArrayArgs(const PrototypeAST &Proto) {
+  for (unsigned i = 0; i < Proto.getArgs().size(); ++i) {
+    if (Proto.isArrayArg(i)) {
+      return true;
+    }
+  }
+  return false;
+}
 
-       int NextTokPrec = getTokPrecedence();
-       if (TokPrec < NextTokPrec) {
-         RHS = ParseBinOpRHS(TokPrec + 1, std::move(RHS));
-         if (!RHS) {
-           return nullptr;
-         }
-       }
-       LHS = std::make_unique<BinaryExprAST>(static_cast<char>(BinOp), std::move(LHS), std::move(RHS));
-     }
-   }
-   std::unique_ptr<PrototypeAST> ParsePrototype() {
-     if (m_lexer.getCurTok() != tok_identifier) {
-       return LogError<PrototypeAST>("Expected function name in prototype!");
-     }
-     std::string fnName = m_lexer.getIdentifierStr();
-     getNextToken();
+static void reportError(llvm::Error Err) {
+  errorStream() << "Error: " << llvm::toString(std::move(Err)) << '\n';
+}
 
-     if (m_lexer.getCurTok() != '(') {
-       return LogError<PrototypeAST>("Expected '(' in prototype!");
-     }
+Compiler::Compiler() : Compiler(Options()) {}
 
-     std::vector<std::string> ArgNames;
-     // eat '(', then look for identifiers for arguments
-     while(getNextToken() == tok_identifier) { 
-       ArgNames.push_back(m_lexer.getIdentifierStr());
-     }
-     if (m_lexer.getCurTok() != ')') {
-       return LogError<PrototypeAST>("Expected ')' in prototype!");
-     }
-     getNextToken(); // eat ')'
+Compiler::Compiler(const Options &Opts) : State(std::make_unique<CompilerState>()) {
+  static std::once_flag TargetsInitialized;
+  std::call_once(TargetsInitialized, [] {
+    llvm::InitializeNativeTarget();
+    llvm::InitializeNativeTargetAsmPrinter();
+    llvm::InitializeNativeTargetAsmParser();
+  });
 
-     return std::make_unique<PrototypeAST> (fnName, std::move(ArgNames));
-   }
-   std::unique_ptr<FunctionAST> ParseDefinition() {
-     getNextToken(); // eat fn.
-     auto Proto = ParsePrototype();
-     if (!Proto) return nullptr;
+  State->OptLevel = std::min(Opts.OptLevel, 3u);
+  if (Opts.FastMath) {
+    State->GlobalFMF.setFast();
+  }
+  StateScope Scope(*State);
+  auto JTMB = getJITTargetMachineBuilder(nullptr, nullptr);
+  llvm::Error Err = JTMB ? InitializeJIT(std::move(*JTMB), "") : JTMB.takeError();
+  if (Err) {
+    State->JITError = llvm::toString(std::move(Err));
+  }
+}
 
-     if(auto E = ParseExpression()) {
-       return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
-     }
-     return nullptr;
-   }
-   std::unique_ptr<PrototypeAST> ParseExtern() {
-     getNextToken(); // eat incl.
-     return ParsePrototype();
-   }
-   std::unique_ptr<FunctionAST> ParseTopLevelExpr() {
-     if (auto E = ParseExpression()) {
-       auto Proto = std::make_unique<PrototypeAST>("__anon_expr", std::vector<std::string>());
-       return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
-     }
-     return nullptr;
-   }
+// * Names of the memo slots (see MEMOIZATION) in the current module.
+static std::vector<std::string> getMemoSlots() {
+  std::vector<std::string> Slots;
+  for (const llvm::GlobalVariable &G : TheModule->globals()) {
+    if (G.getName().startswith("__memo.")) {
+      Slots.push_back(G.getName().str());
+    }
+  }
+  return Slots;
+}
 
-   void InitializeModuleAndPassManager() {
-    TheContext = std::make_unique<llvm::LLVMContext>();
-    TheModule = std::make_unique<llvm::Module>("small_lang", *TheContext);
-    TheModule->setDataLayout(TheJIT->getDataLayout());
-    Builder = std::make_unique<llvm::IRBuilder<>>(*TheContext);
+// * Frees the memo tables behind Slots, before the code that uses them is removed.
+static void FreeMemoTables(llvm::ArrayRef<std::string> Slots) {
+  for (const std::string &Name : Slots) {
+    auto Addr = LookupInJIT(Name);
+    if (!Addr) {
+      llvm::consumeError(Addr.takeError()); // its module never made it into the JIT
+      continue;
+    }
+    FreeMemoTable(reinterpret_cast<void **>(static_cast<uintptr_t>(*Addr)));
+  }
+}
 
-    TheFPM = std::make_unique<llvm::FunctionPassManager>();
-    TheLAM = std::make_unique<llvm::LoopAnalysisManager>();
-    TheFAM = std::make_unique<llvm::FunctionAnalysisManager>();
-    TheCGAM = std::make_unique<llvm::CGSCCAnalysisManager>();
-    TheMAM = std::make_unique<llvm::ModuleAnalysisManager>();
-    ThePIC = std::make_unique<llvm::PassInstrumentationCallbacks>();
-    TheSI = std::make_unique<llvm::StandardInstrumentations>();
+Compiler::~Compiler() {
+  if (State->TheJIT) {
+    StateScope Scope(*State);
+    FreeMemoTables(State->MemoSlots);
+  }
+}
 
-    TheSI->registerCallbacks(*ThePIC);
+// * Starts a call: clears the errors of the last one and checks there's a JIT.
+static bool beginCall(CompilerState &S) {
+  S.Errors.clear();
+  if (!TheJIT) {
+    errorStream() << "Error: can't create the JIT: " << S.JITError << '\n';
+    return false;
+  }
+  return true;
+}
 
-    TheFPM->addPass(llvm::InstCombinePass());
-    TheFPM->addPass(llvm::ReassociatePass());
-    TheFPM->addPass(llvm::SimplifyCFGPass());
+Function Compiler::compile(const std::string &Source) {
+  StateScope Scope(*State);
+  if (!beginCall(*State)) {
+    return Function();
+  }
+  lexer L(MemorySource::fromString(Source));
+  parser P(L);
+  P.InitializeModuleAndPassManager();
 
-    llvm::PassBuilder PB;
-    PB.registerModuleAnalyses(*TheMAM);
-    PB.registerFunctionAnalyses(*TheFAM);
-    PB.crossRegisterProxies(*TheLAM, *TheFAM, *TheCGAM, *TheMAM);
-    PB.registerCGSCCAnalyses(*TheCGAM);
-    PB.registerLoopAnalyses(*TheLAM);
-    PB.registerFunctionAnalyses(*TheFAM);
-    PB.registerModuleAnalyses(*TheMAM);
+  std::vector<parser::TopLevelExpr> Exprs;
+  std::vector<std::unique_ptr<PrototypeAST>> Defined;
+  if (!P.CodegenItems(Exprs, Defined)) {
+    return Function();
+  }
+  if (!Exprs.empty()) {
+    errorStream() << "Error: compile() takes definitions only, evaluate expressions with eval()\n";
+    return Function();
+  }
+  if (Defined.empty()) {
+    errorStream() << "Error: no function defined\n";
+    return Function();
+  }
+  for (const auto &Proto : Defined) {
+    if (!hasArrayArgs(*Proto)) {
+      EmitBatchFunction(TheModule->getFunction(Proto->getName()));
+    }
+  }
+  std::vector<std::string> Slots = getMemoSlots();
+  if (auto Err = AddModuleToJIT()) {
+    reportError(std::move(Err));
+    return Function();
+  }
+  State->MemoSlots.insert(State->MemoSlots.end(), Slots.begin(), Slots.end());
+  Symbol Last = Defined.back()->getSymbol();
+  for (auto &Proto : Defined) {
+    Symbol Name = Proto->getSymbol();
+    DefinedProtos[Name] = std::move(Proto);
+  }
+  return lookupDefined(Last);
+}
 
-   }
+// * The JIT'd function of a DefinedProtos entry, with the state swapped in.
+Function Compiler::lookupDefined(unsigned Name) {
+  const auto &Proto = DefinedProtos.lookup(Name);
+  if (!Proto) {
+    errorStream() << "Error: no function named " << Symbols.getName(Name) << '\n';
+    return Function();
+  }
+  auto Addr = LookupInJIT(Proto->getName());
+  if (!Addr) {
+    reportError(Addr.takeError());
+    return Function();
+  }
+  llvm::JITTargetAddress BatchAddr = 0;
+  if (!hasArrayArgs(*Proto)) {
+    auto Batch = LookupInJIT((Proto->getName() + ".batch").str());
+    if (!Batch) {
+      reportError(Batch.takeError());
+      return Function();
+    }
+    BatchAddr = *Batch;
+  }
+  return Function(reinterpret_cast<void *>(static_cast<uintptr_t>(*Addr)),
+                  reinterpret_cast<void *>(static_cast<uintptr_t>(BatchAddr)),
+                  static_cast<unsigned>(Proto->getArgs().size()));
+}
 
-   void HandleDefinition() {
-     if (auto fnAST = ParseDefinition()) {
-       if (auto *fnIR = fnAST->codegen()) {
-         llvm::outs() << "Parsed a function definition:\n";
-         fnIR->print(llvm::errs());
-         llvm::errs() << '\n';
-       }
-     } else {
-       // Skip token for error recovery.
-       getNextToken();
-     }
-   }
-   void HandleExtern() {
-     if(auto ProtoAST = ParseExtern()) {
-       if (auto *fnIR = ProtoAST->codegen()) {
-         llvm::outs() << "Parsed an extern:\n";
-         fnIR->print(llvm::errs());
-         llvm::errs() << '\n';
-         FunctionProtos[ProtoAST->getName()] = std::move(ProtoAST); 
-       }
-     } else {
-       // Skip token for error recovery.
-       getNextToken();
-     }
+Function Compiler::lookup(const std::string &Name) {
+  StateScope Scope(*State);
+  if (!beginCall(*State)) {
+    return Function();
   }
-  void HandleTopLevelExpression() {
-    if (auto fnAST = ParseTopLevelExpr()) {
-        // Check if the top-level expression is an assignment
-        if (dynamic_cast<AssignExprAST*>(fnAST->getProto()->getName().c_str() == nullptr)) {
-            llvm::outs() << "Assignment at top level is not supported.\n";
-            return;
-        }
-        if (auto *fnIR = fnAST->codegen()) {  
-            llvm::outs() << "Parsed a top-level expr:\n";
-            fnIR->print(llvm::errs());
-            llvm::errs() << '\n';
+  return lookupDefined(Symbols.intern(Name));
+}
 
-            if (TheJIT) {
-                ExitOnErr(TheJIT->addIRModule(
-                    llvm::orc::ThreadSafeModule(std::move(TheModule), std::move(TheContext))
-                ));
+bool Compiler::eval(const std::string &Source, double &Result) {
+  StateScope Scope(*State);
+  if (!beginCall(*State)) {
+    return false;
+  }
+  lexer L(MemorySource::fromString(Source));
+  parser P(L);
+  P.InitializeModuleAndPassManager();
 
-                InitializeModuleAndPassManager(); 
+  std::vector<parser::TopLevelExpr> Exprs;
+  std::vector<std::unique_ptr<PrototypeAST>> Defined;
+  if (!P.CodegenItems(Exprs, Defined)) {
+    return false;
+  }
+  if (Exprs.empty()) {
+    errorStream() << "Error: nothing to evaluate\n";
+    return false;
+  }
+  // Folded expressions are pure: if they all were, there is nothing to run.
+  if (llvm::all_of(Exprs, [](const parser::TopLevelExpr &E) { return E.Name.empty(); })) {
+    Result = Exprs.back().Value;
+    return true;
+  }
 
-                auto ExprSymbol = ExitOnErr(TheJIT->lookup("__anon_expr"));
-                auto Addr = ExprSymbol.getAddress();
-                auto *FP = reinterpret_cast<double (*)()>(static_cast<uintptr_t>(Addr));
-                llvm::outs() << "Evaluated to: " << FP() << "\n";
-            }
-        }
-    } else {
-        getNextToken();
+  // The module, with the functions Source defined, is freed once it ran.
+  std::vector<std::string> Slots = getMemoSlots();
+  auto RT = TheJIT->getMainJITDylib().createResourceTracker();
+  if (auto Err = AddModuleToJIT(RT)) {
+    reportError(std::move(Err));
+    return false;
+  }
+  bool OK = true;
+  for (const parser::TopLevelExpr &E : Exprs) {
+    if (E.Name.empty()) {
+      Result = E.Value;
+      continue;
     }
-   }
-  void MainLoop() {
-    while (true) {
-      llvm::outs() << "ready> ";
-      switch (m_lexer.getCurTok()) { 
-        case tok_eof:
-          llvm::outs() << "Exiting.\n";
-          return;
-        case ';': // ignore top-level semicolons.
-          getNextToken();
-          break;
-        case tok_def:
-          HandleDefinition();
-          break;
-        case tok_extern:
-          HandleExtern();
-          break;
-        default:
-          HandleTopLevelExpression();
-          break;
-       }
-     }
-   }
-};
+    auto Addr = LookupInJIT(E.Name);
+    if (!Addr) {
+      reportError(Addr.takeError());
+      OK = false;
+      break;
+    }
+    Result = reinterpret_cast<double (*)()>(static_cast<uintptr_t>(*Addr))();
+  }
+  FreeMemoTables(Slots);
+  if (auto Err = RT->remove()) {
+    reportError(std::move(Err));
+    OK = false;
+  }
+  return OK;
+}
 
-#ifdef _WIN32
-#define DLLEXPORT __declspec(dllexport)
+const std::string &Compiler::error() const { return State->Errors; }
+
+} // namespace basiclang
+// END LIBRARY API
+
+#ifndef BASIC_LANG_LIBRARY
+int main(int argc, char **argv) {
+  bool BenchParse = false, HeapAST = false, SimplifyStats = false, MemoStats = false;
+  const char *InputFile = nullptr;
+  std::string CacheDir, StatsFile, OutputFile;
+  const char *CPU = nullptr, *Features = nullptr;
+
+  // `basic-lang run file.bl` compiles and runs the whole file non-interactively.
+  bool Batch = argc > 1 && std::strcmp(argv[1], "run") == 0;
+  // `basic-lang build file.bl -o out.so` compiles it ahead of time instead.
+  bool Build = argc > 1 && std::strcmp(argv[1], "build") == 0;
+  // `basic-lang bench` times every compiler stage on a generated program, the
+  // basic-lang-bench build target does nothing else.
+#ifdef BASIC_LANG_BENCH
+  bool StageBench = true;
+  int FirstArg = 1;
 #else
-#define DLLEXPORT
+  bool StageBench = argc > 1 && std::strcmp(argv[1], "bench") == 0;
+  int FirstArg = Batch || Build || StageBench ? 2 : 1;
 #endif
+  StageBenchOptions BenchOpts;
+  for (int i = FirstArg; i < argc; ++i) {
+    if (StageBench && llvm::StringRef(argv[i]).startswith("--functions=")) {
+      BenchOpts.Functions = std::atoi(argv[i] + strlen("--functions="));
+    } else if (StageBench && llvm::StringRef(argv[i]).startswith("--depth=")) {
+      BenchOpts.Depth = std::atoi(argv[i] + strlen("--depth="));
+    } else if (StageBench && llvm::StringRef(argv[i]).startswith("--jit-modules=")) {
+      BenchOpts.JitModules = std::atoi(argv[i] + strlen("--jit-modules="));
+    } else if (StageBench && llvm::StringRef(argv[i]).startswith("--repeat=")) {
+      BenchOpts.Repeat = std::atoi(argv[i] + strlen("--repeat="));
+    } else if (StageBench && llvm::StringRef(argv[i]).startswith("--seed=")) {
+      BenchOpts.Seed = std::atoi(argv[i] + strlen("--seed="));
+    } else if (StageBench && llvm::StringRef(argv[i]).startswith("--rows=")) {
+      BenchOpts.Rows = std::atoi(argv[i] + strlen("--rows="));
+    } else if (Build && std::strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+      OutputFile = argv[++i];
+    } else if (std::strcmp(argv[i], "--bench-parse") == 0) {
+      BenchParse = true;
+    } else if (std::strcmp(argv[i], "--heap-ast") == 0) {
+      HeapAST = true;
+    } else if (std::strlen(argv[i]) == 3 && argv[i][0] == '-' && argv[i][1] == 'O' &&
+               argv[i][2] >= '0' && argv[i][2] <= '3') {
+      OptLevel = argv[i][2] - '0';
+    } else if (llvm::StringRef(argv[i]).startswith("--cache-dir=")) {
+      CacheDir = llvm::StringRef(argv[i]).drop_front(strlen("--cache-dir=")).str();
+    } else if (std::strcmp(argv[i], "--no-simplify") == 0) {
+      SimplifyAST = false;
+    } else if (std::strcmp(argv[i], "--simplify-stats") == 0) {
+      SimplifyStats = true;
+    } else if (std::strcmp(argv[i], "--fast-math") == 0) {
+      GlobalFMF.setFast();
+    } else if (std::strcmp(argv[i], "--fp-contract=fast") == 0) {
+      GlobalFMF.setAllowContract(true);
+    } else if (std::strcmp(argv[i], "--fp-contract=off") == 0) {
+      GlobalFMF.setAllowContract(false);
+    } else if (llvm::StringRef(argv[i]).startswith("--memo-size=")) {
+      MemoCapacity = std::max(1L, std::atol(argv[i] + strlen("--memo-size=")));
+    } else if (llvm::StringRef(argv[i]).startswith("--stats=")) {
+      StatsFile = argv[i] + strlen("--stats=");
+      Stats.Enabled = true;
+    } else if (std::strcmp(argv[i], "--memo-stats") == 0) {
+      MemoStats = true;
+    } else if (llvm::StringRef(argv[i]).startswith("--threads=")) {
+      PforThreads = std::atoi(argv[i] + strlen("--threads="));
+    } else if (llvm::StringRef(argv[i]).startswith("--remarks=")) {
+      RemarksFilter = argv[i] + strlen("--remarks=");
+    } else if (llvm::StringRef(argv[i]).startswith("--cpu=")) {
+      CPU = argv[i] + strlen("--cpu=");
+    } else if (llvm::StringRef(argv[i]).startswith("--features=")) {
+      Features = argv[i] + strlen("--features=");
+    } else if (argv[i][0] != '-' && !InputFile) {
+      InputFile = argv[i];
+    } else {
+      llvm::errs() << "Unknown argument: " << argv[i] << '\n';
+      return 1;
+    }
+  }
+  if (Batch && !InputFile) {
+    llvm::errs() << "Usage: basic-lang run <file>\n";
+    return 1;
+  }
+  if (Build && (!InputFile || OutputFile.empty())) {
+    llvm::errs() << "Usage: basic-lang build <file> -o <out.o|out.so>\n";
+    return 1;
+  }
 
-extern "C" double printd(double);
-DLLEXPORT double printd(double x) {
-  std::cout << x << std::endl;
-  return x;
-}
+  // Read from the given file (memory mapped), otherwise from stdin.
+  std::unique_ptr<SourceBuffer> Source;
+  if (InputFile) {
+    Source = MemorySource::fromFile(InputFile);
+    if (!Source) {
+      return 1;
+    }
+  } else {
+    Source = std::make_unique<StdinSource>();
+  }
 
-static auto *printd_addr = (void*)&printd;
+  lexer lex(std::move(Source));
+  parser my_lang(lex);
 
+  if (BenchParse) {
+    return RunParseBenchmark(my_lang, HeapAST);
+  }
 
-int main() {
   llvm::InitializeNativeTarget();
   llvm::InitializeNativeTargetAsmPrinter();
   llvm::InitializeNativeTargetAsmParser();
 
-  lexer lex;
-  parser my_lang(lex);
-
-  TheJIT = ExitOnErr(llvm::orc::LLJITBuilder().create());
-  if (!TheJIT) {
-    llvm::errs() << "Failed to create LLJIT instance.\n";
-    return 1;
+  auto JTMB = ExitOnErr(getJITTargetMachineBuilder(CPU, Features));
+  if (Build) {
+    ExitOnErr(InitializeAOTTarget(std::move(JTMB)));
+  } else {
+    ExitOnErr(InitializeJIT(std::move(JTMB), CacheDir));
   }
 
-  // Register host process symbols for JIT (LLVM 10 way)
-  llvm::sys::DynamicLibrary::LoadLibraryPermanently(nullptr);
-
   my_lang.InitializeModuleAndPassManager();
 
-  llvm::outs() << "ready> ";
-  my_lang.getNextToken();
+  int RC = 0;
+  if (StageBench) {
+    RC = RunStageBenchmarks(BenchOpts);
+  } else if (Batch) {
+    RC = my_lang.RunBatch();
+  } else if (Build) {
+    RC = RunBuild(my_lang, InputFile, OutputFile);
+  } else {
+    llvm::outs() << "ready> ";
+    my_lang.getNextToken();
 
-  my_lang.MainLoop();
+    my_lang.MainLoop();
+  }
 
-  return 0;
-}
\ No newline at end of file
+  if (SimplifyStats) {
+    const ASTSimplifier::Counters &C = my_lang.getSimplifyStats();
+    llvm::errs() << "simplify: " << C.NodesIn << " nodes in, " << C.Removed << " removed ("
+                 << C.Folded << " folded, " << C.Identities << " identities, "
+                 << C.Reassociated << " reassociated), "
+                 << my_lang.getNumConstantExprs() << " constant top-level expressions\n";
+  }
+  if (MemoStats) {
+    PrintMemoStats();
+  }
+  if (!StatsFile.empty() && !Stats.write(StatsFile)) {
+    RC = 1;
+  }
+  return RC;
+}
+#endif // BASIC_LANG_LIBRARY